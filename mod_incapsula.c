@@ -19,8 +19,20 @@
  *
  * Supported directives and defaults:
  *
+ * IncapsulaEngine On
+ * IncapsulaListenerPolicy (unset)
  * IncapsulaIPHeader Incap-Client-IP
  * IncapsulaTrustedProxy 199.83.128.0/21
+ * IncapsulaRemoteIPProxiesHeader (unset)
+ * IncapsulaRemoteIPTrustedProxyList (unset)
+ * IncapsulaExemptSource (unset)
+ * IncapsulaMatcherEngine auto
+ * IncapsulaRemoteIPResolveInterval 0
+ * IncapsulaForwardHeader Off
+ * IncapsulaRemoveHeader Off
+ * IncapsulaDenyShortLinger Off
+ * IncapsulaDenyMode 403
+ * IncapsulaEarlyDenyThreshold 0
  *
  * Version 1.0.0
  */
@@ -32,11 +44,34 @@
 #include "http_connection.h"
 #include "http_protocol.h"
 #include "http_log.h"
+#include "ap_listen.h"
+#include "util_filter.h"
 #include "apr_strings.h"
 #include "apr_lib.h"
 #define APR_WANT_BYTEFUNC
+#define APR_WANT_STRFUNC
 #include "apr_want.h"
 #include "apr_network_io.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#if APR_HAS_THREADS
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#endif
+#include "apr_optional_hooks.h"
+#include "mod_status.h"
+#include "mod_incapsula.h"
+
+#if APR_HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define IC_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 module AP_MODULE_DECLARE_DATA incapsula_module;
 
@@ -55,14 +90,201 @@ static const char* IC_DEFAULT_TRUSTED_PROXY[] = {
 static const size_t IC_DEFAULT_TRUSTED_PROXY_COUNT = 
   sizeof(IC_DEFAULT_TRUSTED_PROXY)/sizeof(char *);
 
+/* Verdicts of a trusted proxy lookup */
+#define IC_MATCH_NONE     INCAPSULA_VERDICT_NONE
+#define IC_MATCH_TRUSTED  INCAPSULA_VERDICT_TRUSTED
+#define IC_MATCH_INTERNAL INCAPSULA_VERDICT_INTERNAL
+#define IC_MATCH_EXEMPT   INCAPSULA_VERDICT_EXEMPT
+
+/* Whether a verdict is that of a proxy trusted to name the client */
+#define IC_TRUSTED(verdict) ((verdict) == IC_MATCH_TRUSTED \
+                             || (verdict) == IC_MATCH_INTERNAL)
+
+/* Matcher engines; auto picks vector for short IPv4 lists, eytzinger
+ * for long ones, and trie otherwise
+ */
+#define IC_ENGINE_AUTO      0
+#define IC_ENGINE_LINEAR    1
+#define IC_ENGINE_TRIE      2
+#define IC_ENGINE_VECTOR    3
+#define IC_ENGINE_EYTZINGER 4
+
+/* The IPv4 ranges past which auto prefers the interval search */
+#define IC_EYTZINGER_MIN  256
+
+/* The host (/32 and /128) entries worth a perfect hash, and the
+ * displacements tried per hash bucket before giving up on one
+ */
+#define IC_HOSTHASH_MIN   4
+#define IC_HOSTHASH_TRIES 65536
+
+#ifdef __GNUC__
+#define IC_PREFETCH(p)    __builtin_prefetch(p)
+#else
+#define IC_PREFETCH(p)    ((void) 0)
+#endif
+
+/* The longest trusted proxy list worth testing one range at a time */
+#define IC_LINEAR_MAX     16
+
+/* Lookups between reorderings of a linear list by hit count */
+#define IC_REORDER_EVERY  4096
+
+/* The most IPv4 ranges the vector kernel tests, and the most lanes
+ * (the peer and the rightmost hops) it classifies in a header walk
+ */
+#define IC_VECTOR_MAX     16
+#define IC_VECTOR_HOPS    8
+
+/* IncapsulaEngine, where 0 (unset) is On; IncapsulaListenerPolicy
+ * may also be Strict, denying as DenyAllButIncapsula does
+ */
+#define IC_ACTIVE_ON      1
+#define IC_ACTIVE_OFF     2
+#define IC_ACTIVE_STRICT  3
+
+/* How DenyAllButIncapsula answers; a full 403 response, a fixed
+ * minimal one, or none at all
+ */
+#define IC_DENY_403       1
+#define IC_DENY_MINIMAL   2
+#define IC_DENY_ABORT     3
+
+/* What becomes of the client ip header once it has been processed */
+#define IC_HEADER_KEEP    1
+#define IC_HEADER_REMOVE  2
+#define IC_HEADER_REPLACE 3
+
+typedef struct {
+    /** APR_INET or APR_INET6 */
+    apr_byte_t family;
+    /** The prefix length in bits */
+    apr_byte_t bits;
+    /** The IC_MATCH_* verdict of addresses within the range */
+    apr_byte_t verdict;
+    /** The network address, IPv4 in the leading four bytes */
+    apr_byte_t addr[16];
+} incapsula_range_t;
+
 typedef struct {
     /** A proxy IP mask to match */
     apr_ipsubnet_t *ip;
     /** Flagged if internal, otherwise an external trusted proxy */
     void  *internal;
+    /** The same mask as a range, to tell which entries overlap */
+    incapsula_range_t range;
 } incapsula_proxymatch_t;
 
 typedef struct {
+    /** Child node indexes by the next address bit, 0 for none */
+    apr_uint32_t child[2];
+    /** The IC_MATCH_* verdict of a range ending at this node */
+    apr_uint32_t verdict;
+} incapsula_trie_node_t;
+
+typedef struct {
+    /** Binary trie nodes, the root at index 0 */
+    incapsula_trie_node_t *nodes;
+    int nelts;
+    /** The address length in bits */
+    int maxbits;
+} incapsula_trie_t;
+
+typedef struct {
+    /** IPv4 ranges in host byte order, most specific first, so the
+     *  first one matching an address is its longest prefix match
+     */
+    apr_uint32_t base[IC_VECTOR_MAX];
+    apr_uint32_t mask[IC_VECTOR_MAX];
+    apr_uint32_t verdict[IC_VECTOR_MAX];
+    int nelts;
+} incapsula_vset_t;
+
+typedef struct {
+    /** Disjoint IPv4 intervals in host byte order, laid out in
+     *  Eytzinger (breadth first) order from index 1, so a search
+     *  touches one cache line per level and prefetches well ahead
+     */
+    apr_uint32_t *end;
+    apr_uint32_t *start;
+    apr_byte_t *verdict;
+    int nelts;
+} incapsula_eytz_t;
+
+typedef struct {
+    /** The seed displacing each bucket's keys into free slots */
+    apr_uint32_t *disp;
+    apr_uint32_t nbuckets;
+    /** One host entry per slot, family 0 when empty */
+    incapsula_addr_t *keys;
+    apr_byte_t *verdict;
+    apr_uint32_t nslots;
+    int nelts;
+} incapsula_hosthash_t;
+
+typedef struct {
+    /** Hits of each proxymatch_ip entry in this child, by config order */
+    volatile apr_uint32_t *hits;
+    /** The order the entries are tested in, most hit first, swapped
+     *  whole for whichever of buf is spare at each reordering
+     */
+    int *volatile order;
+    int *buf[2];
+    int nelts;
+    /** Set when no two overlapping entries differ in verdict, so that
+     *  any order finds the same verdict as the configured one
+     */
+    int reorderable;
+    volatile apr_uint32_t lookups;
+    /** Bumped by each reordering, so a scan can tell it raced one */
+    volatile apr_uint32_t reorders;
+} incapsula_linear_t;
+
+typedef struct {
+    /** A trusted proxy host name, resolved at startup or in the background */
+    const char *name;
+    /** Flagged if internal, otherwise an external trusted proxy */
+    void *internal;
+} incapsula_host_t;
+
+typedef struct {
+    /** The IC_ENGINE_* selected for this list, never auto */
+    int engine;
+    /** Bumped each time a background resolution swaps in a new matcher */
+    apr_uint32_t generation;
+    /** Unique among the matchers of this process, never 0; keys the
+     *  peer verdict cache, so a swapped matcher invalidates its entries
+     */
+    apr_uint32_t serial;
+    /** The sorted and aggregated ranges the engines are built from */
+    incapsula_range_t *ranges;
+    int nranges;
+    /** Ranges dropped as shadowed by another, or merged with a sibling */
+    int shadowed;
+    int merged;
+    incapsula_trie_t trie4;
+    incapsula_trie_t trie6;
+    /** The IPv4 ranges for the vector kernel, if there are few enough */
+    incapsula_vset_t *vset;
+    /** The IPv4 intervals, for the eytzinger engine only */
+    incapsula_eytz_t *eytz;
+    /** The host entries, probed before the trie or intervals */
+    incapsula_hosthash_t *hosts;
+    /** The hit counts and test order, for the linear engine only */
+    incapsula_linear_t *linear;
+} incapsula_matcher_t;
+
+typedef struct {
+    /** The local address, or family 0 for any */
+    incapsula_addr_t addr;
+    apr_port_t port;
+    /** The IC_ACTIVE_* for connections accepted on it */
+    int policy;
+} incapsula_listener_t;
+
+typedef struct {
+    /** IC_ACTIVE_OFF for virtual hosts not behind Incapsula */
+    int active;
     /** The header to retrieve a proxy-via ip list */
     const char *header_name;
     /** A header to record the proxied IP's
@@ -70,8 +292,24 @@ typedef struct {
      * from the proxy-via ip header value list)
      */
     const char *proxies_header_name;
+    /** The single header to pass the client ip to mod_proxy backends in,
+     *  in place of the inbound header_name; "" when Off
+     */
+    const char *forward_header_name;
+    apr_uint32_t forward_header_checksum;
+    /** Set when forward_header_name is an RFC 7239 Forwarded header */
+    int forward_rfc7239;
+    /** The IC_HEADER_* to apply to header_name after processing,
+     *  or 0 when unset (keep)
+     */
+    int header_mode;
+    /** Set to skip the lingering close of connections given a 403 */
+    int deny_short_linger;
+    /** The IC_DENY_* for denied requests, or 0 when unset (403) */
+    int deny_mode;
     /** A list of trusted proxies, ideally configured
      *  with the most commonly encountered listed first
+     *  (the linear engine learns that order in each child)
      */
 
     int deny_all;
@@ -79,6 +317,41 @@ typedef struct {
      * Return 403 otherwise.
      */
     apr_array_header_t *proxymatch_ip;
+    /** The trusted proxies as incapsula_range_t's, including those
+     *  loaded in bulk, which have no proxymatch_ip entry
+     */
+    apr_array_header_t *proxymatch_ranges;
+    /** Set if proxymatch_ranges holds bulk loaded ranges, or is
+     *  extended by background resolution
+     */
+    int ranges_only;
+    /** Trusted proxy host names (incapsula_host_t) */
+    apr_array_header_t *proxymatch_hosts;
+    /** Set once this server lists trusted proxies of its own; the
+     *  defaults seeded in every server do not count, so a virtual host
+     *  without any inherits the main server's list
+     */
+    int proxies_set;
+    /** IncapsulaExemptSource ranges, the main server's included, which
+     *  join proxymatch_ranges only in the compiled matcher
+     */
+    apr_array_header_t *exempt_ranges;
+    /** Seconds between background resolutions of proxymatch_hosts,
+     *  or 0 to resolve them once at startup (main server only)
+     */
+    int resolve_interval;
+    /** Untrusted peer requests per second past which connections from
+     *  untrusted peers are rejected outright, or 0 (main server only)
+     */
+    int early_deny_threshold;
+    /** The incapsula_listener_t policies (main server only) */
+    apr_array_header_t *listeners;
+    /** The IC_ENGINE_* to test trusted proxies with */
+    int engine;
+    /** Compiled from proxymatch_ranges at post_config, and swapped
+     *  atomically by the background resolver
+     */
+    incapsula_matcher_t *volatile matcher;
 } incapsula_config_t;
 
 typedef struct {
@@ -94,10 +367,92 @@ typedef struct {
     /** The most recently modified ip and address record */
     const char *proxied_ip;
     apr_sockaddr_t proxied_addr;
+    /** The Forwarded header value for proxied_ip, built on first use */
+    const char *forwarded;
 } incapsula_conn_t;
 
+typedef struct {
+    /** Requests presenting the client ip header (per child) */
+    volatile apr_uint32_t requests;
+    /** Of those, requests resolved by the single-hop IPv4 fast path */
+    volatile apr_uint32_t fast_path;
+    /** Peer trust checks answered by the peer verdict cache */
+    volatile apr_uint32_t peer_hits;
+    volatile apr_uint32_t peer_misses;
+    /** Requests denied by DenyAllButIncapsula, closing their connection */
+    volatile apr_uint32_t denied;
+    /** Of those, answered by the minimal response, or not at all */
+    volatile apr_uint32_t denied_minimal;
+    volatile apr_uint32_t denied_abort;
+    /** Connections from untrusted peers rejected by early deny */
+    volatile apr_uint32_t early_denied;
+    /** Requests let past DenyAllButIncapsula by IncapsulaExemptSource */
+    volatile apr_uint32_t exempt;
+    /** Requests to virtual hosts with IncapsulaEngine Off */
+    volatile apr_uint32_t skipped;
+} incapsula_stats_t;
+
+static incapsula_stats_t incapsula_stats;
+
+typedef struct {
+    /** The second count is for */
+    volatile apr_uint32_t window;
+    /** Untrusted peer requests and connections seen that second */
+    volatile apr_uint32_t count;
+    /** Set while connections from untrusted peers are rejected */
+    volatile apr_uint32_t active;
+} incapsula_rate_t;
+
+/* Shared by all children, in shared memory created at post_config */
+static incapsula_rate_t *incapsula_rate;
+static apr_uint32_t early_deny_threshold;
+
+/* The main server's listeners array, or NULL when none is configured */
+static const apr_array_header_t *incapsula_listeners;
+
+/* Slots in the direct-mapped peer verdict cache, a power of 2 */
+#define IC_PEER_CACHE     256
+
+typedef struct {
+    /** Odd while the slot is being rewritten */
+    volatile apr_uint32_t seq;
+    /** The serial of the matcher the verdict came from, 0 when empty */
+    apr_uint32_t serial;
+    apr_uint32_t verdict;
+    incapsula_addr_t addr;
+} incapsula_peer_t;
+
+/* Per child, since each child has its own copy after fork */
+static incapsula_peer_t incapsula_peers[IC_PEER_CACHE];
+static volatile apr_uint32_t incapsula_serial;
+
+typedef struct {
+    /** A superseded ip to be recorded in the proxy list */
+    const char *ip;
+    apr_size_t len;
+} incapsula_hop_t;
+
 static apr_status_t set_ic_default_proxies(apr_pool_t *p, incapsula_config_t *config);
 
+/* Mirrors COMPUTE_KEY_CHECKSUM of apr/tables/apr_tables.c, for
+ * set_header() to find the entries it overwrites in place.
+ */
+static apr_uint32_t header_checksum(const char *key)
+{
+    apr_uint32_t c = (apr_uint32_t) *key;
+    apr_uint32_t checksum = c;
+    int i;
+
+    for (i = 0; i < 3; ++i) {
+        checksum <<= 8;
+        if (c) {
+            c = (apr_uint32_t) *++key;
+            checksum |= c;
+        }
+    }
+    return checksum & 0xdfdfdfdf;
+}
+
 static void *create_incapsula_server_config(apr_pool_t *p, server_rec *s)
 {
     incapsula_config_t *config = apr_pcalloc(p, sizeof *config);
@@ -122,18 +477,71 @@ static void *merge_incapsula_server_config(apr_pool_t *p, void *globalv,
     incapsula_config_t *config;
 
     config = (incapsula_config_t *) apr_palloc(p, sizeof(*config));
+    config->active = server->active
+                   ? server->active
+                   : global->active;
     config->header_name = server->header_name
                         ? server->header_name
                         : global->header_name;
     config->proxies_header_name = server->proxies_header_name
                                 ? server->proxies_header_name
                                 : global->proxies_header_name;
-    config->proxymatch_ip = server->proxymatch_ip
+    config->forward_header_name = server->forward_header_name
+                                ? server->forward_header_name
+                                : global->forward_header_name;
+    config->forward_header_checksum = server->forward_header_name
+                                    ? server->forward_header_checksum
+                                    : global->forward_header_checksum;
+    config->forward_rfc7239 = server->forward_header_name
+                            ? server->forward_rfc7239
+                            : global->forward_rfc7239;
+    config->header_mode = server->header_mode
+                        ? server->header_mode
+                        : global->header_mode;
+    config->deny_all = server->deny_all || global->deny_all;
+    config->deny_short_linger = server->deny_short_linger
+                             || global->deny_short_linger;
+    config->deny_mode = server->deny_mode
+                      ? server->deny_mode
+                      : global->deny_mode;
+    config->proxymatch_ip = server->proxies_set
                           ? server->proxymatch_ip
                           : global->proxymatch_ip;
+    config->proxymatch_ranges = server->proxies_set
+                              ? server->proxymatch_ranges
+                              : global->proxymatch_ranges;
+    config->ranges_only = server->proxies_set
+                        ? server->ranges_only
+                        : global->ranges_only;
+    config->proxymatch_hosts = server->proxies_set
+                             ? server->proxymatch_hosts
+                             : global->proxymatch_hosts;
+    config->proxies_set = server->proxies_set || global->proxies_set;
+    if (!server->exempt_ranges)
+        config->exempt_ranges = global->exempt_ranges;
+    else if (!global->exempt_ranges)
+        config->exempt_ranges = server->exempt_ranges;
+    else
+        config->exempt_ranges = apr_array_append(p, server->exempt_ranges,
+                                                 global->exempt_ranges);
+    config->resolve_interval = global->resolve_interval;
+    config->early_deny_threshold = global->early_deny_threshold;
+    config->listeners = global->listeners;
+    config->engine = server->engine
+                   ? server->engine
+                   : global->engine;
+    config->matcher = NULL;
     return config;
 }
 
+static const char *active_set(cmd_parms *cmd, void *dummy, int flag)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    config->active = flag ? IC_ACTIVE_ON : IC_ACTIVE_OFF;
+    return NULL;
+}
+
 static const char *header_name_set(cmd_parms *cmd, void *dummy,
                                    const char *arg)
 {
@@ -143,6 +551,28 @@ static const char *header_name_set(cmd_parms *cmd, void *dummy,
     return NULL;
 }
 
+static const char *proxies_header_name_set(cmd_parms *cmd, void *dummy,
+                                           const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    config->proxies_header_name = apr_pstrdup(cmd->pool, arg);
+    return NULL;
+}
+
+static const char *forward_header_name_set(cmd_parms *cmd, void *dummy,
+                                           const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    if (!strcasecmp(arg, "Off"))
+        arg = "";
+    config->forward_header_name = apr_pstrdup(cmd->pool, arg);
+    config->forward_header_checksum = header_checksum(arg);
+    config->forward_rfc7239 = !strcasecmp(arg, "Forwarded");
+    return NULL;
+}
+
 static const char *deny_all_set(cmd_parms *cmd, void *dummy)
 {
     incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
@@ -151,6 +581,31 @@ static const char *deny_all_set(cmd_parms *cmd, void *dummy)
     return NULL;
 }
 
+static const char *deny_short_linger_set(cmd_parms *cmd, void *dummy,
+                                         int flag)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    config->deny_short_linger = flag;
+    return NULL;
+}
+
+static const char *deny_mode_set(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    if (!strcmp(arg, "403"))
+        config->deny_mode = IC_DENY_403;
+    else if (!strcasecmp(arg, "Minimal"))
+        config->deny_mode = IC_DENY_MINIMAL;
+    else if (!strcasecmp(arg, "Abort"))
+        config->deny_mode = IC_DENY_ABORT;
+    else
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " must be one of 403, Minimal or Abort", NULL);
+    return NULL;
+}
+
 /* Would be quite nice if APR exported this */
 /* apr:network_io/unix/sockaddr.c */
 static int looks_like_ip(const char *ipstr)
@@ -166,190 +621,1835 @@ static int looks_like_ip(const char *ipstr)
     return (*ipstr == '\0');
 }
 
-static apr_status_t set_ic_default_proxies(apr_pool_t *p, incapsula_config_t *config)
+#define RANGE_BIT(addr, n) (((addr)[(n) >> 3] >> (7 - ((n) & 7))) & 1)
+
+/* Parse ip and its optional mask into range, accepting the forms of
+ * apr_ipsubnet_create(): IPv4 or IPv6 literals with a prefix length,
+ * IPv4 netmasks, and unmasked partial dotted quads such as "10.1"
+ * which imply their own prefix length.  Host bits are cleared.
+ */
+static int parse_range(incapsula_range_t *range, const char *ip,
+                       const char *mask)
 {
-     apr_status_t rv;
-     incapsula_proxymatch_t *match;
-     int i;
-     char **proxies = IC_DEFAULT_TRUSTED_PROXY;
+    int maxbits;
+    int i;
 
-     for (i = 0; i < IC_DEFAULT_TRUSTED_PROXY_COUNT; i++) {
-         char *ip = apr_pstrdup(p, proxies[i]);
-         char *s = ap_strchr(ip, '/');
+    memset(range, 0, sizeof(*range));
+    if (ap_strchr_c(ip, ':')) {
+#if APR_HAVE_IPV6
+        if (inet_pton(AF_INET6, ip, range->addr) <= 0)
+            return 0;
+        range->family = APR_INET6;
+        range->bits = maxbits = 128;
+#else
+        return 0;
+#endif
+    }
+    else {
+        apr_uint32_t a = 0;
+        int octets = 0;
+
+        do {
+            apr_uint32_t octet = 0;
+
+            if (octets && *(ip++) != '.')
+                return 0;
+            if (!apr_isdigit(*ip))
+                return 0;
+            while (apr_isdigit(*ip)) {
+                octet = octet * 10 + (*(ip++) - '0');
+                if (octet > 255)
+                    return 0;
+            }
+            a = (a << 8) | octet;
+        } while (++octets < 4 && *ip);
+        if (*ip || (mask && octets < 4))
+            return 0;
+
+        a = htonl(a << (8 * (4 - octets)));
+        memcpy(range->addr, &a, 4);
+        range->family = APR_INET;
+        range->bits = 8 * octets;
+        maxbits = 32;
+    }
 
-         if (s) {
-             *s++ = '\0';
-         }
-         if (!config->proxymatch_ip) {
-             config->proxymatch_ip = apr_array_make(p, 1, sizeof(*match));
-         }
+    if (mask && range->family == APR_INET && ap_strchr_c(mask, '.')) {
+        apr_uint32_t m;
 
-         match = (incapsula_proxymatch_t *) apr_array_push(config->proxymatch_ip);
-         rv = apr_ipsubnet_create(&match->ip, ip, s, p);
-     }
-     return rv;
+        if (inet_pton(AF_INET, mask, &m) <= 0)
+            return 0;
+        m = ntohl(m);
+        for (range->bits = 0; m & 0x80000000; m <<= 1)
+            ++range->bits;
+        if (m)
+            return 0;
+    }
+    else if (mask) {
+        int bits = 0;
+
+        if (!*mask)
+            return 0;
+        for (; *mask; ++mask) {
+            if (!apr_isdigit(*mask) || (bits = bits * 10 + (*mask - '0')) > maxbits)
+                return 0;
+        }
+        range->bits = bits;
+    }
+
+    for (i = 0; i < maxbits / 8; ++i) {
+        int keep = range->bits - 8 * i;
+
+        if (keep <= 0)
+            range->addr[i] = 0;
+        else if (keep < 8)
+            range->addr[i] &= (apr_byte_t) (0xff << (8 - keep));
+    }
+    return 1;
 }
 
-static const char *proxies_set(cmd_parms *cmd, void *internal,
-                               const char *arg)
+static int range_cmp(const void *av, const void *bv)
 {
-    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
-                                                       &incapsula_module);
-    incapsula_proxymatch_t *match;
-    apr_status_t rv;
-    char *ip = apr_pstrdup(cmd->temp_pool, arg);
-    char *s = ap_strchr(ip, '/');
-    if (s)
-        *s++ = '\0';
-
-    if (!config->proxymatch_ip)
-        config->proxymatch_ip = apr_array_make(cmd->pool, 1, sizeof(*match));
-    match = (incapsula_proxymatch_t *) apr_array_push(config->proxymatch_ip);
-    match->internal = internal;
+    const incapsula_range_t *a = (const incapsula_range_t *) av;
+    const incapsula_range_t *b = (const incapsula_range_t *) bv;
+    int rc;
+
+    if (a->family != b->family)
+        return a->family < b->family ? -1 : 1;
+    if ((rc = memcmp(a->addr, b->addr, sizeof(a->addr))))
+        return rc;
+    if (a->bits != b->bits)
+        return a->bits < b->bits ? -1 : 1;
+    return (int) a->verdict - (int) b->verdict;
+}
 
-    if (looks_like_ip(ip)) {
-        /* Note s may be null, that's fine (explicit host) */
-        rv = apr_ipsubnet_create(&match->ip, ip, s, cmd->pool);
-    }
-    else
-    {
-        apr_sockaddr_t *temp_sa;
+/* Does outer contain inner (or equal it)? */
+static int range_contains(const incapsula_range_t *outer,
+                          const incapsula_range_t *inner)
+{
+    int bytes = outer->bits / 8;
+    int rest = outer->bits % 8;
+
+    if (outer->family != inner->family || outer->bits > inner->bits)
+        return 0;
+    if (memcmp(outer->addr, inner->addr, bytes))
+        return 0;
+    return !rest || !((outer->addr[bytes] ^ inner->addr[bytes])
+                      & (apr_byte_t) (0xff << (8 - rest)));
+}
 
-        if (s) {
-            return apr_pstrcat(cmd->pool, "RemoteIP: Error parsing IP ", arg,
-                               " the subnet /", s, " is invalid for ",
-                               cmd->cmd->name, NULL);
+/* Sort the ranges and aggregate them in place: drop those shadowed
+ * by their innermost enclosing range of the same verdict, or by an
+ * identical one, and merge sibling pairs of the same verdict into
+ * their parent, until nothing changes.  The most specific range
+ * containing an address still yields the same verdict after this.
+ *
+ * Exemptions inside a trusted or internal range are dropped as well:
+ * the linear engine tests the proxy list before the exemptions, so
+ * the proxy's verdict wins there whatever the prefix lengths.
+ */
+static int aggregate_ranges(incapsula_range_t *ranges, int nelts,
+                            int *shadowed, int *merged)
+{
+    int outer[129];
+    /* The trusted or internal ranges among outer[0] to outer[depth] */
+    int proxied[129];
+    int changed;
+
+    qsort(ranges, nelts, sizeof(*ranges), range_cmp);
+    do {
+        incapsula_range_t prev;
+        int depth = 0;
+        int i, n;
+
+        changed = 0;
+        for (i = n = 0; i < nelts; ++i) {
+            /* Identical ranges sort by verdict, the first one wins */
+            if (i && prev.bits == ranges[i].bits
+                  && range_contains(&prev, &ranges[i])) {
+                ++*shadowed;
+                continue;
+            }
+            prev = ranges[i];
+            while (depth && !range_contains(&ranges[outer[depth - 1]],
+                                            &ranges[i]))
+                --depth;
+            if (depth && (ranges[outer[depth - 1]].verdict == ranges[i].verdict
+                          || (ranges[i].verdict == IC_MATCH_EXEMPT
+                              && proxied[depth - 1]))) {
+                ++*shadowed;
+                continue;
+            }
+            ranges[n] = ranges[i];
+            proxied[depth] = (depth ? proxied[depth - 1] : 0)
+                           + (ranges[i].verdict != IC_MATCH_EXEMPT);
+            outer[depth++] = n++;
         }
+        nelts = n;
+
+        for (i = n = 0; i < nelts; ++i) {
+            incapsula_range_t *a = &ranges[i];
+            incapsula_range_t *b = &ranges[i + 1];
+
+            ranges[n] = *a;
+            if (i + 1 < nelts && a->family == b->family && a->bits == b->bits
+                    && a->bits && a->verdict == b->verdict
+                    && !RANGE_BIT(a->addr, a->bits - 1)) {
+                incapsula_range_t parent = *a;
+
+                --parent.bits;
+                /* ...unless the parent is already listed, just before a */
+                if (range_contains(&parent, b)
+                        && !(n && range_contains(&ranges[n - 1], &parent)
+                             && ranges[n - 1].bits == parent.bits)) {
+                    ranges[n] = parent;
+                    ++*merged;
+                    changed = 1;
+                    ++i;
+                }
+            }
+            ++n;
+        }
+        nelts = n;
+    } while (changed);
 
-        rv = apr_sockaddr_info_get(&temp_sa,  ip, APR_UNSPEC, 0,
-                                   APR_IPV4_ADDR_OK, cmd->temp_pool);
-        while (rv == APR_SUCCESS)
-        {
-            apr_sockaddr_ip_get(&ip, temp_sa);
-            rv = apr_ipsubnet_create(&match->ip, ip, NULL, cmd->pool);
-            if (!(temp_sa = temp_sa->next))
-                break;
-            match = (incapsula_proxymatch_t *)
-                    apr_array_push(config->proxymatch_ip);
-            match->internal = internal;
+    return nelts;
+}
+
+static void trie_build(apr_pool_t *p, incapsula_trie_t *trie, int family,
+                       const incapsula_range_t *ranges, int nelts)
+{
+    apr_array_header_t *nodes;
+    incapsula_trie_node_t *node;
+    int i, b;
+
+    nodes = apr_array_make(p, 64, sizeof(incapsula_trie_node_t));
+    apr_array_push(nodes);
+    for (i = 0; i < nelts; ++i) {
+        apr_uint32_t n = 0;
+
+        if (ranges[i].family != family)
+            continue;
+        for (b = 0; b < ranges[i].bits; ++b) {
+            int bit = RANGE_BIT(ranges[i].addr, b);
+
+            node = &((incapsula_trie_node_t *) nodes->elts)[n];
+            if (!node->child[bit]) {
+                apr_array_push(nodes);
+                node = &((incapsula_trie_node_t *) nodes->elts)[n];
+                node->child[bit] = nodes->nelts - 1;
+            }
+            n = node->child[bit];
         }
+        ((incapsula_trie_node_t *) nodes->elts)[n].verdict = ranges[i].verdict;
     }
+    trie->nodes = (incapsula_trie_node_t *) nodes->elts;
+    trie->nelts = nodes->nelts;
+    trie->maxbits = family == APR_INET ? 32 : 128;
+}
 
-    if (rv != APR_SUCCESS) {
-        char msgbuf[128];
-        apr_strerror(rv, msgbuf, sizeof(msgbuf));
-        return apr_pstrcat(cmd->pool, "RemoteIP: Error parsing IP ", arg,
-                           " (", msgbuf, " error) for ", cmd->cmd->name, NULL);
+static int trie_lookup(const incapsula_trie_t *trie, const apr_byte_t *addr)
+{
+    const incapsula_trie_node_t *nodes = trie->nodes;
+    apr_uint32_t n = 0;
+    int verdict;
+    int b;
+
+    if (!nodes)
+        return IC_MATCH_NONE;
+    verdict = nodes[0].verdict;
+    for (b = 0; b < trie->maxbits; ++b) {
+        if (!(n = nodes[n].child[RANGE_BIT(addr, b)]))
+            break;
+        if (nodes[n].verdict)
+            verdict = nodes[n].verdict;
     }
-
-    return NULL;
+    return verdict;
 }
 
-static int incapsula_modify_connection(request_rec *r)
+static void vset_classify_scalar(const incapsula_vset_t *vset,
+                                 const apr_uint32_t *addrs, int n,
+                                 int *verdicts)
 {
-    conn_rec *c = r->connection;
-    incapsula_config_t *config = (incapsula_config_t *)
-        ap_get_module_config(r->server->module_config, &incapsula_module);
+    int i, r;
 
-    incapsula_conn_t *conn;
-#ifdef REMOTEIP_OPTIMIZED
-    apr_sockaddr_t temp_sa_buff;
-    apr_sockaddr_t *temp_sa = &temp_sa_buff;
-#else
-    apr_sockaddr_t *temp_sa;
-#endif
-    apr_status_t rv;
-    char *remote = (char *) apr_table_get(r->headers_in, config->header_name);
-    char *proxy_ips = NULL;
-    char *parse_remote;
-    char *eos;
-    unsigned char *addrbyte;
-    void *internal = NULL;
+    for (i = 0; i < n; ++i) {
+        verdicts[i] = IC_MATCH_NONE;
+        for (r = 0; r < vset->nelts; ++r) {
+            if ((addrs[i] & vset->mask[r]) == vset->base[r]) {
+                verdicts[i] = vset->verdict[r];
+                break;
+            }
+        }
+    }
+}
 
-    apr_pool_userdata_get((void*)&conn, "mod_incapsula-conn", c->pool);
+#ifdef IC_HAVE_X86_SIMD
 
-    if (conn) {
-        if (remote && (strcmp(remote, conn->prior_remote) == 0)) {
-            /* TODO: Recycle r-> overrides from previous request
-             */
-            goto ditto_request_rec;
-        }
-        else {
-            /* TODO: Revert connection from previous request
-             */
-#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
-            c->client_addr = conn->orig_addr;
-            c->client_ip = (char *) conn->orig_ip;
-#else
-            c->remote_addr = conn->orig_addr;
-            c->remote_ip = (char *) conn->orig_ip;
-#endif
+/* Test 4 addresses per range with SSE2, part of the x86_64 baseline */
+static void vset_classify_sse2(const incapsula_vset_t *vset,
+                               const apr_uint32_t *addrs, int n,
+                               int *verdicts)
+{
+    int i, r;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i addr = _mm_loadu_si128((const __m128i *) (addrs + i));
+        __m128i found = _mm_setzero_si128();
+        __m128i result = _mm_setzero_si128();
+
+        for (r = 0; r < vset->nelts; ++r) {
+            __m128i eq = _mm_cmpeq_epi32(
+                _mm_and_si128(addr, _mm_set1_epi32(vset->mask[r])),
+                _mm_set1_epi32(vset->base[r]));
+
+            result = _mm_or_si128(result, _mm_and_si128(
+                _mm_andnot_si128(found, eq),
+                _mm_set1_epi32(vset->verdict[r])));
+            found = _mm_or_si128(found, eq);
+            if (_mm_movemask_epi8(found) == 0xffff)
+                break;
         }
+        _mm_storeu_si128((__m128i *) (verdicts + i), result);
     }
+    vset_classify_scalar(vset, addrs + i, n - i, verdicts + i);
+}
 
-    /* Deny requests that do not have a IncapsulaRemoteIPHeader set when
-     * DenyAllButIncapsula is set. Do not modify the request otherwise and
-     * return early.
-     */
-    if (!remote) {
-        if (config->deny_all) {
-            return 403;
+/* Test 8 addresses per range with AVX2, where the CPU has it */
+__attribute__((target("avx2")))
+static void vset_classify_avx2(const incapsula_vset_t *vset,
+                               const apr_uint32_t *addrs, int n,
+                               int *verdicts)
+{
+    int i, r;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i addr = _mm256_loadu_si256((const __m256i *) (addrs + i));
+        __m256i found = _mm256_setzero_si256();
+        __m256i result = _mm256_setzero_si256();
+
+        for (r = 0; r < vset->nelts; ++r) {
+            __m256i eq = _mm256_cmpeq_epi32(
+                _mm256_and_si256(addr, _mm256_set1_epi32(vset->mask[r])),
+                _mm256_set1_epi32(vset->base[r]));
+
+            result = _mm256_or_si256(result, _mm256_and_si256(
+                _mm256_andnot_si256(found, eq),
+                _mm256_set1_epi32(vset->verdict[r])));
+            found = _mm256_or_si256(found, eq);
+            if (_mm256_movemask_epi8(found) == -1)
+                break;
         }
-
-        return OK;
+        _mm256_storeu_si256((__m256i *) (verdicts + i), result);
     }
+    vset_classify_sse2(vset, addrs + i, n - i, verdicts + i);
+}
 
-    remote = apr_pstrdup(r->pool, remote);
+#endif /* IC_HAVE_X86_SIMD */
 
-#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+/* The kernel for this CPU, chosen by select_vset_kernel() */
+static void (*vset_classify)(const incapsula_vset_t *vset,
+                             const apr_uint32_t *addrs, int n,
+                             int *verdicts) = vset_classify_scalar;
+static const char *vset_kernel = "scalar";
 
-#ifdef REMOTEIP_OPTIMIZED
-    memcpy(temp_sa, c->client_addr, sizeof(*temp_sa));
-    temp_sa->pool = r->pool;
-#else
-    temp_sa = c->client_addr;
+static void select_vset_kernel(void)
+{
+#ifdef IC_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vset_classify = vset_classify_avx2;
+        vset_kernel = "avx2";
+    }
+    else {
+        vset_classify = vset_classify_sse2;
+        vset_kernel = "sse2";
+    }
 #endif
+}
 
-#else
+static incapsula_vset_t *vset_build(apr_pool_t *p,
+                                    const incapsula_range_t *ranges,
+                                    int nelts)
+{
+    incapsula_vset_t *vset = apr_pcalloc(p, sizeof(*vset));
+    int i, j;
+
+    for (i = 0; i < nelts; ++i) {
+        apr_uint32_t base, mask;
+
+        if (ranges[i].family != APR_INET)
+            continue;
+        if (vset->nelts == IC_VECTOR_MAX)
+            return NULL;
+
+        /* Insertion sort, most specific first */
+        mask = ranges[i].bits ? 0xffffffffU << (32 - ranges[i].bits) : 0;
+        for (j = vset->nelts++; j && vset->mask[j - 1] < mask; --j) {
+            vset->base[j] = vset->base[j - 1];
+            vset->mask[j] = vset->mask[j - 1];
+            vset->verdict[j] = vset->verdict[j - 1];
+        }
+        memcpy(&base, ranges[i].addr, 4);
+        vset->base[j] = ntohl(base);
+        vset->mask[j] = mask;
+        vset->verdict[j] = ranges[i].verdict;
+    }
+    return vset;
+}
 
-#ifdef REMOTEIP_OPTIMIZED
-    memcpy(temp_sa, c->remote_addr, sizeof(*temp_sa));
-    temp_sa->pool = r->pool;
-#else
-    temp_sa = c->remote_addr;
-#endif
+/* Flatten the IPv4 trie below node n, at depth bits for prefix, into
+ * sorted disjoint intervals, merging neighbours with the same verdict
+ */
+static void eytz_flatten(const incapsula_trie_t *trie, apr_uint32_t n,
+                         int depth, apr_uint32_t prefix, int verdict,
+                         apr_array_header_t *out)
+{
+    const incapsula_trie_node_t *node = &trie->nodes[n];
+    int bit;
 
-#endif
+    if (node->verdict)
+        verdict = node->verdict;
 
-    while (remote) {
+    for (bit = 0; bit < 2; ++bit) {
+        apr_uint32_t start, end;
+        incapsula_range_t *last;
 
-        /* verify c->client_addr is trusted if there is a trusted proxy list
-         */
-        if (config->proxymatch_ip) {
-            int i;
-            incapsula_proxymatch_t *match;
-            match = (incapsula_proxymatch_t *)config->proxymatch_ip->elts;
-            for (i = 0; i < config->proxymatch_ip->nelts; ++i) {
-#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
-                if (apr_ipsubnet_test(match[i].ip, c->client_addr)) {
-                    internal = match[i].internal;
+        if (depth == 32) {
+            if (bit)
+                break;
+            start = end = prefix;
+        }
+        else if (!node->child[0] && !node->child[1]) {
+            if (bit)
+                break;
+            start = prefix;
+            end = prefix | (0xffffffffU >> depth);
+        }
+        else if (node->child[bit]) {
+            eytz_flatten(trie, node->child[bit], depth + 1,
+                         prefix | ((apr_uint32_t) bit << (31 - depth)),
+                         verdict, out);
+            continue;
+        }
+        else {
+            start = prefix | ((apr_uint32_t) bit << (31 - depth));
+            end = start | (depth < 31 ? 0xffffffffU >> (depth + 1) : 0);
+        }
+
+        if (verdict == IC_MATCH_NONE)
+            continue;
+        /* Reuse incapsula_range_t's address bytes as start and end */
+        last = out->nelts ? &APR_ARRAY_IDX(out, out->nelts - 1,
+                                           incapsula_range_t) : NULL;
+        if (last && last->verdict == verdict) {
+            apr_uint32_t last_end;
+
+            memcpy(&last_end, last->addr + 4, 4);
+            if (last_end + 1 == start) {
+                memcpy(last->addr + 4, &end, 4);
+                continue;
+            }
+        }
+        last = (incapsula_range_t *) apr_array_push(out);
+        last->verdict = verdict;
+        memcpy(last->addr, &start, 4);
+        memcpy(last->addr + 4, &end, 4);
+    }
+}
+
+/* Place sorted intervals [i..] in-order into the Eytzinger tree at k */
+static int eytz_fill(incapsula_eytz_t *eytz, const incapsula_range_t *sorted,
+                     int i, int k)
+{
+    if (k <= eytz->nelts) {
+        i = eytz_fill(eytz, sorted, i, 2 * k);
+        memcpy(&eytz->start[k], sorted[i].addr, 4);
+        memcpy(&eytz->end[k], sorted[i].addr + 4, 4);
+        eytz->verdict[k] = sorted[i++].verdict;
+        i = eytz_fill(eytz, sorted, i, 2 * k + 1);
+    }
+    return i;
+}
+
+static incapsula_eytz_t *eytz_build(apr_pool_t *p,
+                                    const incapsula_trie_t *trie)
+{
+    incapsula_eytz_t *eytz = apr_pcalloc(p, sizeof(*eytz));
+    apr_array_header_t *sorted = apr_array_make(p, 64,
+                                                sizeof(incapsula_range_t));
+
+    if (trie->nodes)
+        eytz_flatten(trie, 0, 0, 0, IC_MATCH_NONE, sorted);
+    eytz->nelts = sorted->nelts;
+    eytz->end = apr_palloc(p, (sorted->nelts + 1) * sizeof(apr_uint32_t));
+    eytz->start = apr_palloc(p, (sorted->nelts + 1) * sizeof(apr_uint32_t));
+    eytz->verdict = apr_palloc(p, sorted->nelts + 1);
+    eytz_fill(eytz, (incapsula_range_t *) sorted->elts, 0, 1);
+    return eytz;
+}
+
+/* Find the first interval ending at or after a, without branching on
+ * the comparisons, and check that it starts at or before a
+ */
+static int eytz_lookup(const incapsula_eytz_t *eytz, apr_uint32_t a)
+{
+    const apr_uint32_t *end = eytz->end;
+    apr_size_t n = eytz->nelts;
+    apr_size_t k = 1;
+
+    while (k <= n) {
+        /* 16 ends to a cache line: four levels down */
+        IC_PREFETCH(end + k * 16);
+        k = 2 * k + (end[k] < a);
+    }
+    /* Drop the right turns after the last left turn, and that one */
+    while (k & 1)
+        k >>= 1;
+    k >>= 1;
+    return k && eytz->start[k] <= a ? eytz->verdict[k] : IC_MATCH_NONE;
+}
+
+static apr_uint32_t host_hash(const apr_byte_t *addr, apr_size_t len,
+                              apr_uint32_t seed)
+{
+    apr_uint32_t h = 2166136261U ^ seed;
+    apr_size_t i;
+
+    for (i = 0; i < len; ++i)
+        h = (h ^ addr[i]) * 16777619U;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    return h ^ (h >> 16);
+}
+
+typedef struct {
+    apr_uint32_t bucket;
+    int size;
+} incapsula_bucket_t;
+
+static int bucket_cmp(const void *a, const void *b)
+{
+    return ((const incapsula_bucket_t *) b)->size
+         - ((const incapsula_bucket_t *) a)->size;
+}
+
+/* Build a CHD style (hash and displace) perfect hash of the host
+ * ranges: keys are hashed into buckets of about four, and from the
+ * largest bucket down, each bucket gets the first seed that hashes
+ * all of its keys into free slots.  A lookup is then two hashes and
+ * one slot compare, whatever the number of hosts.  Returns NULL if
+ * there are too few hosts to bother, or no seed works for a bucket.
+ */
+static incapsula_hosthash_t *hosthash_build(apr_pool_t *p,
+                                            const incapsula_range_t *ranges,
+                                            int nranges)
+{
+    incapsula_hosthash_t *hh;
+    incapsula_bucket_t *order;
+    apr_uint32_t *first, *member, *bucketed;
+    apr_pool_t *tmp;
+    int *host;
+    int n = 0;
+    int i, j, k;
+
+    for (i = 0; i < nranges; ++i)
+        n += ranges[i].bits == (ranges[i].family == APR_INET ? 32 : 128);
+    if (n < IC_HOSTHASH_MIN)
+        return NULL;
+
+    apr_pool_create(&tmp, p);
+    hh = apr_pcalloc(p, sizeof(*hh));
+    hh->nelts = n;
+    hh->nbuckets = n / 4 + 1;
+    hh->nslots = n + n / 4 + 1;
+    hh->disp = apr_pcalloc(p, hh->nbuckets * sizeof(apr_uint32_t));
+    hh->keys = apr_pcalloc(p, hh->nslots * sizeof(incapsula_addr_t));
+    hh->verdict = apr_pcalloc(p, hh->nslots);
+
+    /* Counting sort of the hosts by bucket */
+    host = apr_palloc(tmp, n * sizeof(int));
+    member = apr_palloc(tmp, n * sizeof(apr_uint32_t));
+    first = apr_pcalloc(tmp, (hh->nbuckets + 1) * sizeof(apr_uint32_t));
+    order = apr_palloc(tmp, hh->nbuckets * sizeof(*order));
+    bucketed = apr_palloc(tmp, n * sizeof(apr_uint32_t));
+    for (i = 0, j = 0; i < nranges; ++i) {
+        int len = ranges[i].family == APR_INET ? 4 : 16;
+
+        if (ranges[i].bits != len * 8)
+            continue;
+        host[j] = i;
+        member[j] = host_hash(ranges[i].addr, len, 0) % hh->nbuckets;
+        ++first[member[j++] + 1];
+    }
+    for (i = 0; i < (int) hh->nbuckets; ++i) {
+        order[i].bucket = i;
+        order[i].size = first[i + 1];
+        first[i + 1] += first[i];
+    }
+    for (j = 0; j < n; ++j)
+        bucketed[first[member[j]]++] = host[j];
+    for (i = hh->nbuckets; i > 0; --i)
+        first[i] = first[i - 1];
+    first[0] = 0;
+    qsort(order, hh->nbuckets, sizeof(*order), bucket_cmp);
+
+    for (i = 0; i < (int) hh->nbuckets && order[i].size; ++i) {
+        const apr_uint32_t *keys = bucketed + first[order[i].bucket];
+        apr_uint32_t seed;
+
+        for (seed = 1; seed <= IC_HOSTHASH_TRIES; ++seed) {
+            for (j = 0; j < order[i].size; ++j) {
+                const incapsula_range_t *r = &ranges[keys[j]];
+
+                member[j] = host_hash(r->addr, r->bits / 8, seed)
+                          % hh->nslots;
+                if (hh->keys[member[j]].family)
                     break;
-                }
-#else
-                if (apr_ipsubnet_test(match[i].ip, c->remote_addr)) {
-                    internal = match[i].internal;
+                for (k = 0; k < j && member[k] != member[j]; ++k)
+                    ;
+                if (k < j)
                     break;
-                }
+            }
+            if (j == order[i].size)
+                break;
+        }
+        if (seed > IC_HOSTHASH_TRIES) {
+            apr_pool_destroy(tmp);
+            return NULL;
+        }
+
+        hh->disp[order[i].bucket] = seed;
+        for (j = 0; j < order[i].size; ++j) {
+            const incapsula_range_t *r = &ranges[keys[j]];
+
+            hh->keys[member[j]].family = r->family;
+            memcpy(hh->keys[member[j]].addr, r->addr, r->bits / 8);
+            hh->verdict[member[j]] = r->verdict;
+        }
+    }
+    apr_pool_destroy(tmp);
+    return hh;
+}
+
+static int hosthash_lookup(const incapsula_hosthash_t *hh, int family,
+                           const apr_byte_t *addr)
+{
+    apr_size_t len = family == APR_INET ? 4 : 16;
+    apr_uint32_t b = host_hash(addr, len, 0) % hh->nbuckets;
+    apr_uint32_t s = host_hash(addr, len, hh->disp[b]) % hh->nslots;
+
+    if (hh->keys[s].family == family && !memcmp(hh->keys[s].addr, addr, len))
+        return hh->verdict[s];
+    return IC_MATCH_NONE;
+}
+
+static incapsula_matcher_t *build_matcher(apr_pool_t *p,
+                                          const apr_array_header_t *ranges,
+                                          int engine)
+{
+    incapsula_matcher_t *matcher = apr_pcalloc(p, sizeof(*matcher));
+
+    matcher->serial = apr_atomic_inc32(&incapsula_serial) + 1;
+    matcher->ranges = apr_pmemdup(p, ranges->elts,
+                                  ranges->nelts * sizeof(incapsula_range_t));
+    matcher->nranges = aggregate_ranges(matcher->ranges, ranges->nelts,
+                                        &matcher->shadowed, &matcher->merged);
+    matcher->vset = vset_build(p, matcher->ranges, matcher->nranges);
+    /* Built for the linear engine too, which is only used for requests;
+     * batch classification always takes the trie
+     */
+    trie_build(p, &matcher->trie4, APR_INET,
+               matcher->ranges, matcher->nranges);
+#if APR_HAVE_IPV6
+    trie_build(p, &matcher->trie6, APR_INET6,
+               matcher->ranges, matcher->nranges);
 #endif
+
+    if (engine == IC_ENGINE_AUTO) {
+        int nv4 = 0;
+        int i;
+
+        for (i = 0; i < matcher->nranges; ++i)
+            nv4 += matcher->ranges[i].family == APR_INET;
+        engine = matcher->vset ? IC_ENGINE_VECTOR
+               : nv4 > IC_EYTZINGER_MIN ? IC_ENGINE_EYTZINGER
+               : IC_ENGINE_TRIE;
+    }
+    else if (engine == IC_ENGINE_VECTOR && !matcher->vset) {
+        engine = IC_ENGINE_TRIE;
+    }
+    matcher->engine = engine;
+    if (engine == IC_ENGINE_EYTZINGER)
+        matcher->eytz = eytz_build(p, &matcher->trie4);
+    /* Hosts stay in the prefix structures as well, so the hash only
+     * short cuts hits; a host is always the longest prefix it matches.
+     * The vector kernel is already a single pass, and the linear
+     * engine keeps first match semantics.
+     */
+    if (engine == IC_ENGINE_TRIE || engine == IC_ENGINE_EYTZINGER)
+        matcher->hosts = hosthash_build(p, matcher->ranges, matcher->nranges);
+    return matcher;
+}
+
+static int v4_lookup(const incapsula_matcher_t *matcher,
+                     const apr_byte_t *addr)
+{
+    int verdict;
+
+    if (matcher->hosts
+            && (verdict = hosthash_lookup(matcher->hosts, APR_INET, addr)))
+        return verdict;
+    if (matcher->engine == IC_ENGINE_VECTOR) {
+        apr_uint32_t a;
+
+        memcpy(&a, addr, 4);
+        a = ntohl(a);
+        vset_classify_scalar(matcher->vset, &a, 1, &verdict);
+        return verdict;
+    }
+    if (matcher->engine == IC_ENGINE_EYTZINGER) {
+        apr_uint32_t a;
+
+        memcpy(&a, addr, 4);
+        return eytz_lookup(matcher->eytz, ntohl(a));
+    }
+    return trie_lookup(&matcher->trie4, addr);
+}
+
+static int matcher_lookup_addr(const incapsula_matcher_t *matcher,
+                               int family, const apr_byte_t *addr)
+{
+#if APR_HAVE_IPV6
+    if (family == APR_INET6) {
+        static const apr_byte_t v4mapped[12] = { 0, 0, 0, 0, 0, 0,
+                                                 0, 0, 0, 0, 0xff, 0xff };
+        int verdict;
+
+        /* IPv4-mapped peers match IPv4 ranges, as with apr_ipsubnet_test */
+        if (!memcmp(addr, v4mapped, sizeof(v4mapped))
+                && (verdict = v4_lookup(matcher, addr + 12)))
+            return verdict;
+        if (matcher->hosts
+                && (verdict = hosthash_lookup(matcher->hosts, family, addr)))
+            return verdict;
+        return trie_lookup(&matcher->trie6, addr);
+    }
+#endif
+    return v4_lookup(matcher, addr);
+}
+
+/* The IPv4 address of an IPv4 or IPv4-mapped address, host byte order */
+static int v4_addr(int family, const apr_byte_t *addr, apr_uint32_t *a)
+{
+    static const apr_byte_t v4mapped[12] = { 0, 0, 0, 0, 0, 0,
+                                             0, 0, 0, 0, 0xff, 0xff };
+
+    if (family == APR_INET)
+        memcpy(a, addr, 4);
+    else if (!memcmp(addr, v4mapped, sizeof(v4mapped)))
+        memcpy(a, addr + 12, 4);
+    else
+        return 0;
+    *a = ntohl(*a);
+    return 1;
+}
+
+/* Classify up to IC_BATCH addresses; IPv4 ones are gathered for the
+ * vector kernel when the matcher has a vset, the rest are looked up
+ * one at a time.
+ */
+#define IC_BATCH 64
+static void matcher_classify(const incapsula_matcher_t *matcher, int n,
+                             const int *family, const apr_byte_t *const *addr,
+                             int *verdicts)
+{
+    apr_uint32_t v4[IC_BATCH];
+    int lane[IC_BATCH];
+    int result[IC_BATCH];
+    int nv4 = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (matcher->vset && v4_addr(family[i], addr[i], &v4[nv4]))
+            lane[nv4++] = i;
+        else
+            verdicts[i] = matcher_lookup_addr(matcher, family[i], addr[i]);
+    }
+    if (!nv4)
+        return;
+
+    vset_classify(matcher->vset, v4, nv4, result);
+    for (i = 0; i < nv4; ++i) {
+        verdicts[lane[i]] = result[i];
+#if APR_HAVE_IPV6
+        if (!result[i] && family[lane[i]] == APR_INET6)
+            verdicts[lane[i]] = trie_lookup(&matcher->trie6, addr[lane[i]]);
+#endif
+    }
+}
+
+/* Could an address match both ranges?  IPv4-mapped peers match IPv4
+ * entries, so IPv6 ranges that may hold them overlap every IPv4 one.
+ */
+static int linear_overlap(const incapsula_range_t *a,
+                          const incapsula_range_t *b)
+{
+    if (a->family != b->family) {
+        const incapsula_range_t *v6 = a->family == APR_INET6 ? a : b;
+
+        return v6->bits < 16 || !(v6->addr[0] | v6->addr[1]);
+    }
+    return range_contains(a, b) || range_contains(b, a);
+}
+
+static incapsula_linear_t *linear_build(apr_pool_t *p,
+                                        const apr_array_header_t *proxymatch)
+{
+    const incapsula_proxymatch_t *match =
+        (const incapsula_proxymatch_t *) proxymatch->elts;
+    incapsula_linear_t *linear = apr_pcalloc(p, sizeof(*linear));
+    int i, j;
+
+    linear->nelts = proxymatch->nelts;
+    linear->hits = apr_pcalloc(p, linear->nelts * sizeof(apr_uint32_t));
+    linear->buf[0] = apr_palloc(p, linear->nelts * sizeof(int));
+    linear->buf[1] = apr_palloc(p, linear->nelts * sizeof(int));
+    for (i = 0; i < linear->nelts; ++i)
+        linear->buf[0][i] = i;
+    linear->order = linear->buf[0];
+
+    /* The first match wins, so only entries which cannot disagree
+     * with an earlier one may be moved ahead of it
+     */
+    linear->reorderable = 1;
+    for (i = 0; i < linear->nelts && linear->reorderable; ++i) {
+        for (j = i + 1; j < linear->nelts; ++j) {
+            if (!match[i].internal != !match[j].internal
+                    && linear_overlap(&match[i].range, &match[j].range)) {
+                linear->reorderable = 0;
+                break;
             }
-            if (i && i >= config->proxymatch_ip->nelts) {
-                if (config->deny_all) {
-                    return 403;
-                } else {
-                    break;
-                }
+        }
+    }
+    return linear;
+}
+
+/* Sort the entries by hits into the spare order buffer, ties kept in
+ * config order, and swap it in.  Hits keep counting meanwhile, which
+ * at worst leaves the order slightly stale; it is a permutation still.
+ */
+static void linear_reorder(incapsula_linear_t *linear)
+{
+    int *next = linear->order == linear->buf[0] ? linear->buf[1]
+                                                : linear->buf[0];
+    int i, j;
+
+    apr_atomic_inc32(&linear->reorders);
+    for (i = 0; i < linear->nelts; ++i) {
+        apr_uint32_t hits = linear->hits[i];
+
+        for (j = i; j > 0 && linear->hits[next[j - 1]] < hits; --j)
+            next[j] = next[j - 1];
+        next[j] = i;
+    }
+    apr_atomic_xchgptr((volatile void **) &linear->order, next);
+}
+
+/* The index of the first proxymatch entry containing sa, hottest
+ * first, or -1.  A miss is only trusted if no reordering rewrote the
+ * order buffer under the scan, otherwise it is retried in config order.
+ */
+static int linear_find(incapsula_linear_t *linear,
+                       const incapsula_proxymatch_t *match,
+                       apr_sockaddr_t *sa)
+{
+    apr_uint32_t reorders = apr_atomic_read32(&linear->reorders);
+    const int *order = linear->order;
+    int i;
+
+    if ((apr_atomic_inc32(&linear->lookups) + 1) % IC_REORDER_EVERY == 0
+            && linear->reorderable)
+        linear_reorder(linear);
+
+    if (linear->reorderable) {
+        for (i = 0; i < linear->nelts; ++i) {
+            if (apr_ipsubnet_test(match[order[i]].ip, sa)) {
+                apr_atomic_inc32(&linear->hits[order[i]]);
+                return order[i];
+            }
+        }
+        if (apr_atomic_read32(&linear->reorders) == reorders)
+            return -1;
+    }
+    for (i = 0; i < linear->nelts; ++i) {
+        if (apr_ipsubnet_test(match[i].ip, sa)) {
+            apr_atomic_inc32(&linear->hits[i]);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void compile_matcher(apr_pool_t *p, server_rec *s,
+                            incapsula_config_t *config)
+{
+    int engine = config->engine;
+    apr_array_header_t *ranges;
+
+    /* Ranges resolved in the background may yet join an empty list */
+    if (!config->proxymatch_ranges || (!config->proxymatch_ranges->nelts
+                                       && !config->ranges_only))
+        return;
+    ranges = config->exempt_ranges
+           ? apr_array_append(p, config->proxymatch_ranges,
+                              config->exempt_ranges)
+           : config->proxymatch_ranges;
+
+    if (engine == IC_ENGINE_LINEAR && config->ranges_only) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "IncapsulaMatcherEngine linear cannot test bulk loaded "
+                     "or background resolved proxies, using trie");
+        engine = IC_ENGINE_TRIE;
+    }
+    config->matcher = build_matcher(p, ranges, engine);
+    if (config->matcher->engine == IC_ENGINE_LINEAR && config->proxymatch_ip)
+        config->matcher->linear = linear_build(p, config->proxymatch_ip);
+    if (engine == IC_ENGINE_VECTOR && config->matcher->engine != engine) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "IncapsulaMatcherEngine vector tests at most %d IPv4 "
+                     "ranges, using trie", IC_VECTOR_MAX);
+    }
+}
+
+static incapsula_range_t *push_range(apr_pool_t *p,
+                                     incapsula_config_t *config,
+                                     const char *ip, const char *mask,
+                                     int verdict)
+{
+    incapsula_range_t *range;
+
+    if (!config->proxymatch_ranges)
+        config->proxymatch_ranges = apr_array_make(p, 8, sizeof(*range));
+    range = (incapsula_range_t *) apr_array_push(config->proxymatch_ranges);
+    if (!parse_range(range, ip, mask)) {
+        --config->proxymatch_ranges->nelts;
+        return NULL;
+    }
+    range->verdict = verdict;
+    return range;
+}
+
+static apr_status_t set_ic_default_proxies(apr_pool_t *p, incapsula_config_t *config)
+{
+     apr_status_t rv;
+     incapsula_proxymatch_t *match;
+     incapsula_range_t *range;
+     int i;
+     char **proxies = IC_DEFAULT_TRUSTED_PROXY;
+
+     for (i = 0; i < IC_DEFAULT_TRUSTED_PROXY_COUNT; i++) {
+         char *ip = apr_pstrdup(p, proxies[i]);
+         char *s = ap_strchr(ip, '/');
+
+         if (s) {
+             *s++ = '\0';
+         }
+         if (!config->proxymatch_ip) {
+             config->proxymatch_ip = apr_array_make(p, 1, sizeof(*match));
+         }
+
+         match = (incapsula_proxymatch_t *) apr_array_push(config->proxymatch_ip);
+         rv = apr_ipsubnet_create(&match->ip, ip, s, p);
+         range = push_range(p, config, ip, s, IC_MATCH_TRUSTED);
+         if (range)
+             match->range = *range;
+     }
+     return rv;
+}
+
+static const char *proxies_set(cmd_parms *cmd, void *internal,
+                               const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    incapsula_proxymatch_t *match;
+    apr_status_t rv;
+    char *ip = apr_pstrdup(cmd->temp_pool, arg);
+    char *s = ap_strchr(ip, '/');
+    if (s)
+        *s++ = '\0';
+
+    if (!config->proxymatch_ip)
+        config->proxymatch_ip = apr_array_make(cmd->pool, 1, sizeof(*match));
+    config->proxies_set = 1;
+
+    if (looks_like_ip(ip)) {
+        match = (incapsula_proxymatch_t *) apr_array_push(config->proxymatch_ip);
+        match->internal = internal;
+        /* Note s may be null, that's fine (explicit host) */
+        rv = apr_ipsubnet_create(&match->ip, ip, s, cmd->pool);
+        if (rv == APR_SUCCESS) {
+            incapsula_range_t *range =
+                push_range(cmd->pool, config, ip, s,
+                           internal ? IC_MATCH_INTERNAL : IC_MATCH_TRUSTED);
+            if (range)
+                match->range = *range;
+            else
+                rv = APR_EINVAL;
+        }
+    }
+    else
+    {
+        incapsula_host_t *host;
+
+        if (s) {
+            return apr_pstrcat(cmd->pool, "RemoteIP: Error parsing IP ", arg,
+                               " the subnet /", s, " is invalid for ",
+                               cmd->cmd->name, NULL);
+        }
+
+        /* Resolved at post_config, or in the background, see
+         * IncapsulaRemoteIPResolveInterval
+         */
+        if (!config->proxymatch_hosts)
+            config->proxymatch_hosts = apr_array_make(cmd->pool, 1,
+                                                      sizeof(*host));
+        host = (incapsula_host_t *) apr_array_push(config->proxymatch_hosts);
+        host->name = apr_pstrdup(cmd->pool, ip);
+        host->internal = internal;
+        rv = APR_SUCCESS;
+    }
+
+    if (rv != APR_SUCCESS) {
+        char msgbuf[128];
+        apr_strerror(rv, msgbuf, sizeof(msgbuf));
+        return apr_pstrcat(cmd->pool, "RemoteIP: Error parsing IP ", arg,
+                           " (", msgbuf, " error) for ", cmd->cmd->name, NULL);
+    }
+
+    return NULL;
+}
+
+static const char *exempt_set(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    incapsula_range_t *range;
+    char *ip = apr_pstrdup(cmd->temp_pool, arg);
+    char *s = ap_strchr(ip, '/');
+    if (s)
+        *s++ = '\0';
+
+    if (!config->exempt_ranges)
+        config->exempt_ranges = apr_array_make(cmd->pool, 1, sizeof(*range));
+    range = (incapsula_range_t *) apr_array_push(config->exempt_ranges);
+    if (!looks_like_ip(ip) || !parse_range(range, ip, s)) {
+        --config->exempt_ranges->nelts;
+        return apr_pstrcat(cmd->pool, "RemoteIP: Error parsing IP ", arg,
+                           " for ", cmd->cmd->name, NULL);
+    }
+    range->verdict = IC_MATCH_EXEMPT;
+    return NULL;
+}
+
+/* Load trusted proxies in bulk, one or more per line with '#'
+ * comments, straight into proxymatch_ranges; unlike
+ * IncapsulaRemoteIPTrustedProxy no apr_ipsubnet_t is created, and
+ * host names are not accepted.
+ */
+static const char *proxylist_read(cmd_parms *cmd, void *internal,
+                                  const char *filename)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    ap_configfile_t *cfp;
+    char lbuf[MAX_STRING_LEN];
+    apr_status_t rv;
+
+    filename = ap_server_root_relative(cmd->temp_pool, filename);
+    rv = ap_pcfg_openfile(&cfp, cmd->temp_pool, filename);
+    if (rv != APR_SUCCESS) {
+        return apr_psprintf(cmd->pool, "%s: Could not open file %s: %pm",
+                            cmd->cmd->name, filename, &rv);
+    }
+
+    while (!ap_cfg_getline(lbuf, sizeof(lbuf), cfp)) {
+        char *last;
+        char *ip;
+
+        for (ip = apr_strtok(lbuf, " \t", &last); ip && *ip != '#';
+             ip = apr_strtok(NULL, " \t", &last)) {
+            char *s = ap_strchr(ip, '/');
+
+            if (s)
+                *s++ = '\0';
+            if (!push_range(cmd->pool, config, ip, s,
+                            internal ? IC_MATCH_INTERNAL
+                                     : IC_MATCH_TRUSTED)) {
+                unsigned line = cfp->line_number;
+
+                ap_cfg_closefile(cfp);
+                return apr_psprintf(cmd->pool, "%s: Error parsing IP %s%s%s "
+                                    "at line %u of %s", cmd->cmd->name, ip,
+                                    s ? "/" : "", s ? s : "", line, filename);
+            }
+        }
+    }
+    ap_cfg_closefile(cfp);
+
+    config->ranges_only = 1;
+    config->proxies_set = 1;
+    return NULL;
+}
+
+static const char *engine_set(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    if (!strcasecmp(arg, "auto"))
+        config->engine = IC_ENGINE_AUTO;
+    else if (!strcasecmp(arg, "linear"))
+        config->engine = IC_ENGINE_LINEAR;
+    else if (!strcasecmp(arg, "trie"))
+        config->engine = IC_ENGINE_TRIE;
+    else if (!strcasecmp(arg, "vector"))
+        config->engine = IC_ENGINE_VECTOR;
+    else if (!strcasecmp(arg, "eytzinger"))
+        config->engine = IC_ENGINE_EYTZINGER;
+    else
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " must be one of auto, linear, trie, vector "
+                           "or eytzinger", NULL);
+    return NULL;
+}
+
+static const char *header_mode_set(cmd_parms *cmd, void *dummy,
+                                   const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    if (!strcasecmp(arg, "Off"))
+        config->header_mode = IC_HEADER_KEEP;
+    else if (!strcasecmp(arg, "On"))
+        config->header_mode = IC_HEADER_REMOVE;
+    else if (!strcasecmp(arg, "Replace"))
+        config->header_mode = IC_HEADER_REPLACE;
+    else
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " must be one of Off, On or Replace", NULL);
+    return NULL;
+}
+
+/* Collect a superseded hop; the list is joined only once, by
+ * join_proxy_hops(), after the whole header has been walked.
+ */
+static void push_proxy_hop(apr_pool_t *p, apr_array_header_t **hops,
+                           apr_size_t *len, const char *ip)
+{
+    incapsula_hop_t *hop;
+
+    if (!*hops)
+        *hops = apr_array_make(p, 4, sizeof(*hop));
+    hop = (incapsula_hop_t *) apr_array_push(*hops);
+    hop->ip = ip;
+    hop->len = strlen(ip);
+    *len += hop->len;
+}
+
+/* Join the collected hops as "a, b, c" into a single buffer sized
+ * up front, allocated directly from its final pool.
+ */
+static const char *join_proxy_hops(apr_pool_t *p,
+                                   const apr_array_header_t *hops,
+                                   apr_size_t len)
+{
+    const incapsula_hop_t *hop;
+    char *list, *d;
+    int i;
+
+    if (!hops || !hops->nelts)
+        return NULL;
+
+    hop = (const incapsula_hop_t *) hops->elts;
+    d = list = apr_palloc(p, len + 2 * (hops->nelts - 1) + 1);
+    for (i = 0; i < hops->nelts; ++i) {
+        if (i) {
+            *d++ = ',';
+            *d++ = ' ';
+        }
+        memcpy(d, hop[i].ip, hop[i].len);
+        d += hop[i].len;
+    }
+    *d = '\0';
+    return list;
+}
+
+/* apr_sockaddr_vars_set() isn't public, so mirror it here */
+static void sockaddr_vars_set(apr_sockaddr_t *sa, int family,
+                              apr_port_t port, apr_pool_t *p)
+{
+    sa->family = family;
+    if (family == APR_INET) {
+        sa->salen = sizeof(struct sockaddr_in);
+        sa->addr_str_len = 16;
+        sa->ipaddr_ptr = &sa->sa.sin.sin_addr;
+        sa->ipaddr_len = sizeof(struct in_addr);
+    }
+#if APR_HAVE_IPV6
+    else {
+        sa->salen = sizeof(struct sockaddr_in6);
+        sa->addr_str_len = 46;
+        sa->ipaddr_ptr = &sa->sa.sin6.sin6_addr;
+        sa->ipaddr_len = sizeof(struct in6_addr);
+    }
+#endif
+    sa->pool = p;
+    sa->port = port;
+    sa->sa.sin.sin_family = family;
+    sa->sa.sin.sin_port = htons(port);
+}
+
+/* Decode a literal header ip into addr without resolving or formatting it */
+static apr_status_t decode_hop(incapsula_addr_t *addr, const char *ip)
+{
+    if (inet_pton(AF_INET, ip, addr->addr) > 0) {
+        addr->family = APR_INET;
+    }
+#if APR_HAVE_IPV6
+    else if (inet_pton(AF_INET6, ip, addr->addr) > 0) {
+        addr->family = APR_INET6;
+    }
+#endif
+    else {
+        return APR_EINVAL;
+    }
+    return APR_SUCCESS;
+}
+
+/* The compact form of sa, which is all the walk below works with */
+static void addr_from_sockaddr(incapsula_addr_t *addr,
+                               const apr_sockaddr_t *sa)
+{
+    addr->family = (apr_byte_t) sa->family;
+    memcpy(addr->addr, sa->ipaddr_ptr, sa->ipaddr_len);
+}
+
+/* Expand addr into sa; done only for the final client address */
+static void sockaddr_from_addr(apr_sockaddr_t *sa,
+                               const incapsula_addr_t *addr,
+                               apr_port_t port, apr_pool_t *p)
+{
+    memset(sa, 0, sizeof(*sa));
+    sockaddr_vars_set(sa, addr->family, port, p);
+    memcpy(sa->ipaddr_ptr, addr->addr, sa->ipaddr_len);
+}
+
+/* Cheap prescan for the dominant header form, a single IPv4 literal:
+ * digits and dots only, no longer than 15 bytes.  Returns the length,
+ * or 0 when the general header walk is required.
+ */
+static apr_size_t single_ipv4_len(const char *ip)
+{
+    const char *p = ip;
+
+    while ((*p >= '0' && *p <= '9') || *p == '.') {
+        if (++p - ip > 15)
+            return 0;
+    }
+    return *p ? 0 : p - ip;
+}
+
+/* Parse a prescanned dotted quad into network byte order, rejecting
+ * leading zeros and out of range octets just as inet_pton() does.
+ */
+static int parse_ipv4(const char *ip, apr_size_t len, apr_uint32_t *addr)
+{
+    const char *eos = ip + len;
+    apr_uint32_t a = 0;
+    int parts;
+
+    for (parts = 0; parts < 4; ++parts) {
+        apr_uint32_t octet = 0;
+
+        if (parts && (ip == eos || *(ip++) != '.'))
+            return 0;
+        if (ip == eos || *ip == '.' || (*ip == '0' && ip + 1 < eos
+                                                   && ip[1] != '.'))
+            return 0;
+        while (ip < eos && *ip != '.') {
+            octet = octet * 10 + (*(ip++) - '0');
+            if (octet > 255)
+                return 0;
+        }
+        a = (a << 8) | octet;
+    }
+    if (ip != eos)
+        return 0;
+    *addr = htonl(a);
+    return 1;
+}
+
+/* RFC3330 designated local/private subnets:
+ * 10.0.0.0/8   169.254.0.0/16  192.168.0.0/16
+ * 127.0.0.0/8  172.16.0.0/12
+ */
+static int private_ipv4(const unsigned char *addrbyte)
+{
+    return addrbyte[0] == 10
+        || addrbyte[0] == 127
+        || (addrbyte[0] == 169 && addrbyte[1] == 254)
+        || (addrbyte[0] == 172 && (addrbyte[1] & 0xf0) == 16)
+        || (addrbyte[0] == 192 && addrbyte[1] == 168);
+}
+
+/* Whether a non-Internal proxy may not name addr as its client */
+static int private_addr(const incapsula_addr_t *addr)
+{
+    /* For internet (non-Internal proxies) deny all RFC3330 designated
+     * local/private subnets
+     */
+    if (addr->family == APR_INET)
+        return private_ipv4(addr->addr);
+#if APR_HAVE_IPV6
+    /* IPv4-over-IPv6 mapped addresses are not translated by decode_hop(),
+     * so accept only Global Unicast 2000::/3 defined by RFC4291
+     */
+    if (addr->family == APR_INET6)
+        return (addr->addr[0] & 0xe0) != 0x20;
+#endif
+    return 1;
+}
+
+/* Classify addr against the trusted proxy list and the exemptions,
+ * using matcher as read from config by the caller.  An addr is only
+ * IC_MATCH_NONE when a list is configured and it matches none of its
+ * entries.
+ */
+static int matcher_verdict(const incapsula_config_t *config,
+                           const incapsula_matcher_t *matcher,
+                           const incapsula_addr_t *addr)
+{
+    int i;
+    incapsula_proxymatch_t *match;
+    apr_sockaddr_t sa;
+
+    if (matcher && matcher->engine != IC_ENGINE_LINEAR)
+        return matcher_lookup_addr(matcher, addr->family, addr->addr);
+
+    if (!config->proxymatch_ip || !config->proxymatch_ip->nelts)
+        return IC_MATCH_TRUSTED;
+
+    /* apr_ipsubnet_test() wants the full sockaddr */
+    sockaddr_from_addr(&sa, addr, 0, NULL);
+    match = (incapsula_proxymatch_t *)config->proxymatch_ip->elts;
+    if (matcher && matcher->linear) {
+        if ((i = linear_find(matcher->linear, match, &sa)) >= 0)
+            return match[i].internal ? IC_MATCH_INTERNAL : IC_MATCH_TRUSTED;
+    }
+    else {
+        for (i = 0; i < config->proxymatch_ip->nelts; ++i) {
+            if (apr_ipsubnet_test(match[i].ip, &sa))
+                return match[i].internal ? IC_MATCH_INTERNAL
+                                         : IC_MATCH_TRUSTED;
+        }
+    }
+
+    /* Exemptions are only ever compiled into the matcher */
+    if (matcher && matcher_lookup_addr(matcher, addr->family, addr->addr)
+                       == IC_MATCH_EXEMPT)
+        return IC_MATCH_EXEMPT;
+    return IC_MATCH_NONE;
+}
+
+static int proxy_verdict(const incapsula_config_t *config,
+                         const incapsula_addr_t *addr)
+{
+    return matcher_verdict(config, config->matcher, addr);
+}
+
+static apr_size_t addr_len(const incapsula_addr_t *addr)
+{
+    return addr->family == APR_INET ? 4 : 16;
+}
+
+static incapsula_peer_t *peer_slot(const incapsula_addr_t *addr)
+{
+    apr_uint32_t h = addr->family;
+    apr_size_t i;
+
+    for (i = 0; i < addr_len(addr); ++i)
+        h = h * 31 + addr->addr[i];
+    return &incapsula_peers[(h * 2654435761U) >> 24 & (IC_PEER_CACHE - 1)];
+}
+
+/* Classify the connection's peer like proxy_verdict(), through the peer
+ * verdict cache.  Incapsula opens many short connections from a few
+ * edge addresses, so most new connections are answered by one probe.
+ * Slots are read and written under a sequence count rather than a
+ * lock; a reader racing a writer just misses.  Only peers are cached,
+ * never header hops, which any client may choose.
+ */
+static int peer_verdict(const incapsula_config_t *config,
+                        const incapsula_addr_t *addr)
+{
+    const incapsula_matcher_t *matcher = config->matcher;
+    incapsula_peer_t *slot;
+    apr_uint32_t seq;
+    apr_uint32_t verdict;
+
+    if (!matcher)
+        return matcher_verdict(config, matcher, addr);
+
+    slot = peer_slot(addr);
+    seq = apr_atomic_read32(&slot->seq);
+    if (!(seq & 1) && slot->serial == matcher->serial
+            && slot->addr.family == addr->family
+            && !memcmp(slot->addr.addr, addr->addr, addr_len(addr))) {
+        verdict = slot->verdict;
+        /* cas as a full barrier: the slot is unchanged since seq */
+        if (apr_atomic_cas32(&slot->seq, seq, seq) == seq) {
+            apr_atomic_inc32(&incapsula_stats.peer_hits);
+            return verdict;
+        }
+    }
+
+    apr_atomic_inc32(&incapsula_stats.peer_misses);
+    verdict = matcher_verdict(config, matcher, addr);
+
+    /* Skip the update if another thread holds the slot */
+    seq = apr_atomic_read32(&slot->seq);
+    if (!(seq & 1) && apr_atomic_cas32(&slot->seq, seq + 1, seq) == seq) {
+        slot->serial = matcher->serial;
+        slot->verdict = verdict;
+        slot->addr = *addr;
+        apr_atomic_inc32(&slot->seq);
+    }
+    return verdict;
+}
+
+/* Classify the peer and the rightmost IPv4 hops of the header in one
+ * vector kernel call, so the walk below need not look each one up.
+ * Returns the number of lanes classified; lane 0 is the peer and lane
+ * i the i-th hop from the right, and scanning stops at the first hop
+ * that is not a plain dotted quad.
+ */
+static int prescan_hops(const incapsula_matcher_t *matcher,
+                        const incapsula_addr_t *peer, const char *remote,
+                        int *verdicts)
+{
+    apr_uint32_t addrs[IC_VECTOR_HOPS];
+    const char *eos = remote + strlen(remote);
+    int n = 0;
+
+    if (!v4_addr(peer->family, peer->addr, &addrs[n++]))
+        return 0;
+
+    while (n < IC_VECTOR_HOPS && eos > remote) {
+        const char *end = eos;
+        const char *ip;
+
+        while (end > remote && end[-1] == ' ')
+            --end;
+        for (ip = end; ip > remote && ((ip[-1] >= '0' && ip[-1] <= '9')
+                                       || ip[-1] == '.'); --ip)
+            ;
+        eos = ip;
+        while (eos > remote && eos[-1] == ' ')
+            --eos;
+        if (eos > remote && eos[-1] != ',')
+            break;
+        if (end - ip > 15 || !parse_ipv4(ip, end - ip, &addrs[n]))
+            break;
+        addrs[n] = ntohl(addrs[n]);
+        ++n;
+        if (eos > remote)
+            --eos;
+    }
+
+    vset_classify(matcher->vset, addrs, n, verdicts);
+#if APR_HAVE_IPV6
+    /* As matcher_classify(), a mapped peer may match an IPv6 range */
+    if (!verdicts[0] && peer->family == APR_INET6)
+        verdicts[0] = trie_lookup(&matcher->trie6, peer->addr);
+#endif
+    return n;
+}
+
+/* apr_table_setn(), but overwriting a single existing entry in place
+ * instead of re-adding it; duplicates still go through apr_table_setn()
+ * so that no stale value survives.
+ */
+static void set_header(apr_table_t *t, const char *key,
+                       apr_uint32_t checksum, const char *val)
+{
+    const apr_array_header_t *arr = apr_table_elts(t);
+    apr_table_entry_t *elts = (apr_table_entry_t *) arr->elts;
+    apr_table_entry_t *found = NULL;
+    int i;
+
+    for (i = 0; i < arr->nelts; ++i) {
+        if (elts[i].key_checksum == checksum
+                && !strcasecmp(elts[i].key, key)) {
+            if (found) {
+                apr_table_setn(t, key, val);
+                return;
+            }
+            found = &elts[i];
+        }
+    }
+    if (found)
+        found->val = (char *) val;
+    else
+        apr_table_addn(t, key, val);
+}
+
+static incapsula_conn_t *create_conn(conn_rec *c, apr_sockaddr_t *orig_sa,
+                                     const char *orig_ip)
+{
+    incapsula_conn_t *conn;
+
+    conn = (incapsula_conn_t *) apr_palloc(c->pool, sizeof(*conn));
+    apr_pool_userdata_set(conn, "mod_incapsula-conn", NULL, c->pool);
+    conn->orig_addr = orig_sa;
+    conn->orig_ip = orig_ip;
+    return conn;
+}
+
+/* Count an untrusted peer request or connection against the shared
+ * rate, switching early deny on as soon as a second reaches the
+ * threshold.  It is switched off again once a whole second stays
+ * under half of it, or passes with no untrusted traffic at all; the
+ * gap keeps it from flapping around the threshold.  Whichever process
+ * first sees a new second ends the previous one.
+ */
+static void rate_note(server_rec *s)
+{
+    incapsula_rate_t *rate = incapsula_rate;
+    apr_uint32_t now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    apr_uint32_t window = apr_atomic_read32(&rate->window);
+    apr_uint32_t count;
+
+    if (window != now
+            && apr_atomic_cas32(&rate->window, now, window) == window) {
+        count = apr_atomic_xchg32(&rate->count, 0);
+        if ((now - window > 1 || count < early_deny_threshold / 2)
+                && apr_atomic_xchg32(&rate->active, 0)) {
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                         "RemoteIP: untrusted peer rate below %u/s, "
+                         "leaving early deny", early_deny_threshold / 2);
+        }
+    }
+
+    count = apr_atomic_inc32(&rate->count) + 1;
+    if (count >= early_deny_threshold
+            && apr_atomic_cas32(&rate->active, 1, 0) == 0) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "RemoteIP: untrusted peer rate reached %u/s, "
+                     "rejecting untrusted connections early",
+                     early_deny_threshold);
+    }
+}
+
+/* IncapsulaDenyMode Minimal's whole response, sent as it is */
+static const char incapsula_deny_response[] =
+    "HTTP/1.1 403 Forbidden\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/* Deny a request from a peer outside the trusted proxies.  The
+ * connection is closed after the 403, so a scanner cannot hold a
+ * worker across keepalive requests that will all be denied.
+ *
+ * The Minimal and Abort modes skip the error document machinery
+ * altogether, for floods sent straight to the origin: the fixed
+ * response is written to the connection filters, or nothing is, and
+ * the connection is marked aborted so that nothing more is sent and
+ * it is closed without lingering.  The request is still logged.
+ * Both assume the request owns its connection, as only HTTP/1.x
+ * requests do, so other protocols, HTTP/2 streams in particular, get
+ * the plain 403 instead.
+ */
+static int deny_request(request_rec *r, const incapsula_config_t *config)
+{
+    conn_rec *c = r->connection;
+    apr_bucket_brigade *bb;
+    int mode = config->deny_mode;
+
+    c->keepalive = AP_CONN_CLOSE;
+    apr_atomic_inc32(&incapsula_stats.denied);
+
+    if (r->proto_num < HTTP_VERSION(1,0) || r->proto_num >= HTTP_VERSION(2,0))
+        mode = IC_DENY_403;
+
+    if (mode == IC_DENY_MINIMAL) {
+        bb = apr_brigade_create(r->pool, c->bucket_alloc);
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(
+            incapsula_deny_response, sizeof(incapsula_deny_response) - 1,
+            c->bucket_alloc));
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(c->bucket_alloc));
+        ap_pass_brigade(c->output_filters, bb);
+        apr_atomic_inc32(&incapsula_stats.denied_minimal);
+    }
+    else if (mode == IC_DENY_ABORT) {
+        apr_atomic_inc32(&incapsula_stats.denied_abort);
+    }
+    else {
+        if (config->deny_short_linger)
+            apr_table_setn(c->notes, "short-lingering-close", "1");
+        return 403;
+    }
+
+    r->status = 403;
+    c->aborted = 1;
+    return DONE;
+}
+
+/* Deny a request from a peer that is not a trusted proxy under
+ * DenyAllButIncapsula, unless it is exempt; returns 0 for exempt
+ * peers, whose requests proceed untranslated.
+ */
+static int deny_peer(request_rec *r, const incapsula_config_t *config,
+                     int verdict)
+{
+    if (verdict == IC_MATCH_EXEMPT) {
+        apr_atomic_inc32(&incapsula_stats.exempt);
+        return 0;
+    }
+    if (incapsula_rate)
+        rate_note(r->server);
+    return deny_request(r, config);
+}
+
+/* Remove the processed client ip header, or reduce it to the final
+ * client ip, so later modules and backends have nothing to re-parse.
+ */
+static void finish_header(request_rec *r, const incapsula_config_t *config,
+                          const char *client_ip)
+{
+    if (config->header_mode == IC_HEADER_REMOVE)
+        apr_table_unset(r->headers_in, config->header_name);
+    else if (config->header_mode == IC_HEADER_REPLACE)
+        set_header(r->headers_in, config->header_name,
+                   header_checksum(config->header_name), client_ip);
+}
+
+/* The textual form of a decoded hop.  inet_pton() only accepts
+ * canonical dotted quads, so IPv4 tokens are used as they are, and
+ * IPv6 tokens are reused whenever they match their rendered form.
+ */
+static const char *hop_ip(apr_pool_t *p, const incapsula_addr_t *addr,
+                          const char *token)
+{
+    apr_uint32_t v4;
+    char buf[64];
+
+    if (addr->family == APR_INET)
+        return token;
+    /* Render IPv4-mapped addresses as apr_sockaddr_ip_get() does */
+    if (v4_addr(addr->family, addr->addr, &v4)) {
+        if (!inet_ntop(AF_INET, addr->addr + 12, buf, sizeof(buf)))
+            return token;
+    }
+    else if (!inet_ntop(AF_INET6, addr->addr, buf, sizeof(buf))) {
+        return token;
+    }
+    if (strcmp(buf, token) == 0)
+        return token;
+    return apr_pstrdup(p, buf);
+}
+
+/* The IC_ACTIVE_* in force on a connection: an Off or Strict listener
+ * overrides the virtual host's IncapsulaEngine, while an On listener,
+ * or none, leaves it in charge.
+ */
+static int active_policy(const incapsula_config_t *config,
+                         const incapsula_listener_t *listener)
+{
+    if (listener && listener->policy != IC_ACTIVE_ON)
+        return listener->policy;
+    return config->active == IC_ACTIVE_OFF ? IC_ACTIVE_OFF : IC_ACTIVE_ON;
+}
+
+static int incapsula_modify_connection(request_rec *r)
+{
+    conn_rec *c = r->connection;
+    incapsula_config_t *config = (incapsula_config_t *)
+        ap_get_module_config(r->server->module_config, &incapsula_module);
+
+    incapsula_conn_t *conn;
+    apr_sockaddr_t *orig_sa;
+    incapsula_addr_t peer;
+    incapsula_addr_t client;
+    incapsula_addr_t next;
+    int walked = 0;
+    const char *orig_ip;
+    const char *client_ip;
+    apr_status_t rv;
+    const char *header;
+    char *remote;
+    apr_array_header_t *proxy_hops = NULL;
+    apr_size_t proxy_ips_len = 0;
+    char *parse_remote;
+    char *eos;
+    void *internal = NULL;
+    apr_size_t fast_len;
+    apr_uint32_t fast_addr;
+    incapsula_matcher_t *matcher;
+    int hop_verdict[IC_VECTOR_HOPS];
+    int nhops = 0;
+    int hop = 0;
+    int verdict;
+    int status;
+    const incapsula_listener_t *listener =
+        ap_get_module_config(c->conn_config, &incapsula_module);
+    int active = active_policy(config, listener);
+    int deny_all;
+
+    if (active == IC_ACTIVE_OFF) {
+        apr_atomic_inc32(&incapsula_stats.skipped);
+        return OK;
+    }
+    deny_all = config->deny_all || active == IC_ACTIVE_STRICT;
+
+    /* Backends consume the proxies header directly, so never pass on
+     * one this module did not set itself
+     */
+    if (config->proxies_header_name)
+        apr_table_unset(r->headers_in, config->proxies_header_name);
+
+    header = apr_table_get(r->headers_in, config->header_name);
+    remote = (char *) header;
+
+    apr_pool_userdata_get((void*)&conn, "mod_incapsula-conn", c->pool);
+
+    if (conn) {
+        if (remote && (strcmp(remote, conn->prior_remote) == 0)) {
+            /* TODO: Recycle r-> overrides from previous request
+             */
+            /* A request in between may have reverted the connection */
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+            if (c->client_addr != &conn->proxied_addr)
+                goto apply_conn;
+#else
+            if (c->remote_addr != &conn->proxied_addr)
+                goto apply_conn;
+#endif
+            goto ditto_request_rec;
+        }
+        else {
+            /* TODO: Revert connection from previous request
+             */
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+            c->client_addr = conn->orig_addr;
+            c->client_ip = (char *) conn->orig_ip;
+#else
+            c->remote_addr = conn->orig_addr;
+            c->remote_ip = (char *) conn->orig_ip;
+#endif
+        }
+    }
+
+    /* Deny requests that do not have a IncapsulaRemoteIPHeader set when
+     * DenyAllButIncapsula is set. Do not modify the request otherwise and
+     * return early.
+     */
+    if (!remote) {
+        if (deny_all) {
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+            addr_from_sockaddr(&peer, c->client_addr);
+#else
+            addr_from_sockaddr(&peer, c->remote_addr);
+#endif
+            verdict = peer_verdict(config, &peer);
+            /* An Incapsula edge keeps its pooled connection */
+            if (IC_TRUSTED(verdict))
+                return 403;
+            return deny_peer(r, config, verdict);
+        }
+
+        return OK;
+    }
+
+    apr_atomic_inc32(&incapsula_stats.requests);
+
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    orig_sa = c->client_addr;
+    orig_ip = c->client_ip;
+#else
+    orig_sa = c->remote_addr;
+    orig_ip = c->remote_ip;
+#endif
+    addr_from_sockaddr(&peer, orig_sa);
+
+    /* Fast path: a single public IPv4 literal from a trusted proxy is
+     * decoded straight into the conn rec, skipping the walk below.
+     * Anything unusual falls through to the walk, which logs it.
+     */
+    if ((fast_len = single_ipv4_len(remote))
+            && parse_ipv4(remote, fast_len, &fast_addr)) {
+        verdict = peer_verdict(config, &peer);
+        if (!IC_TRUSTED(verdict)) {
+            if (deny_all && (status = deny_peer(r, config, verdict)))
+                return status;
+            finish_header(r, config, orig_ip);
+            return OK;
+        }
+        internal = verdict == IC_MATCH_INTERNAL ? (void *) 1 : NULL;
+        if (internal || !private_ipv4((unsigned char *) &fast_addr)) {
+            if (!conn)
+                conn = create_conn(c, orig_sa, orig_ip);
+
+            memset(&conn->proxied_addr, 0, sizeof(conn->proxied_addr));
+            conn->proxied_addr.sa.sin.sin_addr.s_addr = fast_addr;
+            sockaddr_vars_set(&conn->proxied_addr, APR_INET,
+                              orig_sa->port, c->pool);
+            /* The header value is the client ip, so one copy serves both */
+            conn->proxied_ip = apr_pstrmemdup(c->pool, remote, fast_len);
+            conn->prior_remote = conn->proxied_ip;
+            conn->proxied_remote = NULL;
+            conn->proxy_ips = internal ? NULL : apr_pstrdup(c->pool, orig_ip);
+            conn->forwarded = NULL;
+
+            apr_atomic_inc32(&incapsula_stats.fast_path);
+            goto apply_conn;
+        }
+    }
+
+    remote = apr_pstrdup(r->pool, remote);
+    client = peer;
+    client_ip = orig_ip;
+
+    matcher = config->matcher;
+    if (matcher && matcher->engine == IC_ENGINE_VECTOR)
+        nhops = prescan_hops(matcher, &peer, remote, hop_verdict);
+
+    while (remote) {
+
+        /* Walk the chain right to left: client is the peer on the
+         * first pass and the hop decoded on the previous pass after
+         * that, and only a trusted proxy may name the next hop.  An
+         * untrusted hop ends the walk as the client, just as in
+         * mod_remoteip; only an untrusted peer is denied.
+         */
+        if (hop < nhops)
+            verdict = hop_verdict[hop++];
+        else if (!walked)
+            verdict = peer_verdict(config, &client);
+        else
+            verdict = proxy_verdict(config, &client);
+
+        if (!IC_TRUSTED(verdict)) {
+            if (deny_all && !walked
+                    && (status = deny_peer(r, config, verdict))) {
+                return status;
+            } else {
+                break;
             }
         }
+        internal = verdict == IC_MATCH_INTERNAL ? (void *) 1 : NULL;
 
         if ((parse_remote = strrchr(remote, ',')) == NULL) {
             parse_remote = remote;
@@ -374,29 +2474,12 @@ static int incapsula_modify_connection(request_rec *r)
             break;
         }
 
-#ifdef REMOTEIP_OPTIMIZED
-        /* Decode client_addr - sucks; apr_sockaddr_vars_set isn't 'public' */
-        if (inet_pton(AF_INET, parse_remote,
-                      &temp_sa->sa.sin.sin_addr) > 0) {
-            apr_sockaddr_vars_set(temp_sa, APR_INET, temp_sa.port);
-        }
-#if APR_HAVE_IPV6
-        else if (inet_pton(AF_INET6, parse_remote,
-                           &temp_sa->sa.sin6.sin6_addr) > 0) {
-            apr_sockaddr_vars_set(temp_sa, APR_INET6, temp_sa.port);
-        }
-#endif
-        else {
-            rv = apr_get_netos_error();
-#else /* !REMOTEIP_OPTIMIZED */
-        /* We map as IPv4 rather than IPv6 for equivilant host names
-         * or IPV4OVERIPV6
+        /* Decode into next, so a rejected hop leaves the accepted client
+         * intact.  Only literal addresses are accepted; header values
+         * are never resolved as host names.
          */
-        rv = apr_sockaddr_info_get(&temp_sa,  parse_remote,
-                                   APR_UNSPEC, temp_sa->port,
-                                   APR_IPV4_ADDR_OK, r->pool);
+        rv = decode_hop(&next, parse_remote);
         if (rv != APR_SUCCESS) {
-#endif
             ap_log_rerror(APLOG_MARK, APLOG_DEBUG,  rv, r,
                           "RemoteIP: Header %s value of %s cannot be parsed "
                           "as a client IP",
@@ -408,30 +2491,8 @@ static int incapsula_modify_connection(request_rec *r)
             break;
         }
 
-        addrbyte = (unsigned char *) &temp_sa->sa.sin.sin_addr;
-
         /* For intranet (Internal proxies) ignore all restrictions below */
-        if (!internal
-              && ((temp_sa->family == APR_INET
-                   /* For internet (non-Internal proxies) deny all
-                    * RFC3330 designated local/private subnets:
-                    * 10.0.0.0/8   169.254.0.0/16  192.168.0.0/16
-                    * 127.0.0.0/8  172.16.0.0/12
-                    */
-                      && (addrbyte[0] == 10
-                       || addrbyte[0] == 127
-                       || (addrbyte[0] == 169 && addrbyte[1] == 254)
-                       || (addrbyte[0] == 172 && (addrbyte[1] & 0xf0) == 16)
-                       || (addrbyte[0] == 192 && addrbyte[1] == 168)))
-#if APR_HAVE_IPV6
-               || (temp_sa->family == APR_INET6
-                   /* For internet (non-Internal proxies) we translated
-                    * IPv4-over-IPv6-mapped addresses as IPv4, above.
-                    * Accept only Global Unicast 2000::/3 defined by RFC4291
-                    */
-                      && ((temp_sa->sa.sin6.sin6_addr.s6_addr[0] & 0xe0) != 0x20))
-#endif
-        )) {
+        if (!internal && private_addr(&next)) {
             ap_log_rerror(APLOG_MARK, APLOG_DEBUG,  rv, r,
                           "RemoteIP: Header %s value of %s appears to be "
                           "a private IP or nonsensical.  Ignored",
@@ -443,106 +2504,77 @@ static int incapsula_modify_connection(request_rec *r)
             break;
         }
 
-#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
-        if (!conn) {
-            conn = (incapsula_conn_t *) apr_palloc(c->pool, sizeof(*conn));
-            apr_pool_userdata_set(conn, "mod_incapsula-conn", NULL, c->pool);
-            conn->orig_addr = c->client_addr;
-            conn->orig_ip = c->client_ip;
-        }
-        /* Set remote_ip string */
-        if (!internal) {
-            if (proxy_ips)
-                proxy_ips = apr_pstrcat(r->pool, proxy_ips, ", ",
-                                        c->client_ip, NULL);
-            else
-                proxy_ips = c->client_ip;
-        }
+        /* Record the superseded ip string */
+        if (!internal)
+            push_proxy_hop(r->pool, &proxy_hops, &proxy_ips_len, client_ip);
 
-        c->client_addr = temp_sa;
-        apr_sockaddr_ip_get(&c->client_ip, c->client_addr);
+        client = next;
+        client_ip = hop_ip(r->pool, &next, parse_remote);
+        ++walked;
     }
 
     /* Nothing happened? */
-    if (!conn || (c->client_addr == conn->orig_addr))
+    if (!walked) {
+        finish_header(r, config, orig_ip);
         return OK;
+    }
+
+    if (!conn)
+        conn = create_conn(c, orig_sa, orig_ip);
 
     /* Fixups here, remote becomes the new Via header value, etc
-     * In the heavy operations above we used request scope, to limit
-     * conn pool memory growth on keepalives, so here we must scope
-     * the final results to the connection pool lifetime.
-     * To limit memory growth, we keep recycling the same buffer
-     * for the final apr_sockaddr_t in the remoteip conn rec.
+     * In the heavy operations above we used request scope and stack
+     * buffers, so here we must scope the final results to the
+     * connection pool lifetime.  This is the only point at which the
+     * client ip string is copied, and to limit memory growth, we keep
+     * recycling the same buffer for the final apr_sockaddr_t in the
+     * remoteip conn rec; this is the one place the compact client
+     * address is expanded.
      */
-    c->client_ip = apr_pstrdup(c->pool, c->client_ip);
-    conn->proxied_ip = c->client_ip;
+    sockaddr_from_addr(&conn->proxied_addr, &client, orig_sa->port, c->pool);
+    conn->proxied_ip = apr_pstrdup(c->pool, client_ip);
 
-    r->useragent_ip = c->client_ip;
-    r->useragent_addr = c->client_addr;
-
-    memcpy(&conn->proxied_addr, temp_sa, sizeof(*temp_sa));
-    conn->proxied_addr.pool = c->pool;
-    c->client_addr = &conn->proxied_addr;
-#else
-        if (!conn) {
-            conn = (incapsula_conn_t *) apr_palloc(c->pool, sizeof(*conn));
-            apr_pool_userdata_set(conn, "mod_incapsula-conn", NULL, c->pool);
-            conn->orig_addr = c->remote_addr;
-            conn->orig_ip = c->remote_ip;
-        }
-
-        /* Set remote_ip string */
-        if (!internal) {
-            if (proxy_ips)
-                proxy_ips = apr_pstrcat(r->pool, proxy_ips, ", ",
-                                        c->remote_ip, NULL);
-            else
-                proxy_ips = c->remote_ip;
-        }
+    if (remote)
+        remote = apr_pstrdup(c->pool, remote);
+    conn->proxied_remote = remote;
+    conn->prior_remote = apr_pstrdup(c->pool, header);
+    conn->proxy_ips = join_proxy_hops(c->pool, proxy_hops, proxy_ips_len);
+    conn->forwarded = NULL;
 
-        c->remote_addr = temp_sa;
-        apr_sockaddr_ip_get(&c->remote_ip, c->remote_addr);
-    }
+apply_conn:
 
-    /* Nothing happened? */
-    if (!conn || (c->remote_addr == conn->orig_addr))
-        return OK;
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    c->client_addr = &conn->proxied_addr;
+    c->client_ip = (char *) conn->proxied_ip;
 
-    /* Fixups here, remote becomes the new Via header value, etc
-     * In the heavy operations above we used request scope, to limit
-     * conn pool memory growth on keepalives, so here we must scope
-     * the final results to the connection pool lifetime.
-     * To limit memory growth, we keep recycling the same buffer
-     * for the final apr_sockaddr_t in the remoteip conn rec.
-     */
-    c->remote_ip = apr_pstrdup(c->pool, c->remote_ip);
-    conn->proxied_ip = c->remote_ip;
-    memcpy(&conn->proxied_addr, temp_sa, sizeof(*temp_sa));
-    conn->proxied_addr.pool = c->pool;
+    r->useragent_ip = c->client_ip;
+    r->useragent_addr = c->client_addr;
+#else
     c->remote_addr = &conn->proxied_addr;
+    c->remote_ip = (char *) conn->proxied_ip;
 #endif
 
-    if (remote)
-        remote = apr_pstrdup(c->pool, remote);
-    conn->proxied_remote = remote;
-    conn->prior_remote = apr_pstrdup(c->pool, apr_table_get(r->headers_in,
-                                                      config->header_name));
-    if (proxy_ips)
-        proxy_ips = apr_pstrdup(c->pool, proxy_ips);
-    conn->proxy_ips = proxy_ips;
-
     /* Unset remote_host string DNS lookups */
     c->remote_host = NULL;
     c->remote_logname = NULL;
 
 ditto_request_rec:
 
+    /* Every value lives as long as the conn rec, so keepalive requests
+     * repeat these without copying
+     */
+    apr_table_setn(r->subprocess_env, "INCAP_CLIENT_IP", conn->proxied_ip);
+    apr_table_setn(r->subprocess_env, "INCAP_PROXY", conn->orig_ip);
+    apr_table_setn(r->subprocess_env, "INCAP_TRUSTED",
+                   conn->proxy_ips ? "1" : "internal");
+
     if (conn->proxy_ips) {
         apr_table_setn(r->notes, "incapsula-proxy-ip-list", conn->proxy_ips);
         if (config->proxies_header_name)
-            apr_table_setn(r->headers_in, config->proxies_header_name,
+            apr_table_addn(r->headers_in, config->proxies_header_name,
                            conn->proxy_ips);
     }
+    finish_header(r, config, conn->proxied_ip);
 
     ap_log_rerror(APLOG_MARK, APLOG_INFO|APLOG_NOERRNO, 0, r,
                   conn->proxy_ips
@@ -552,25 +2584,862 @@ ditto_request_rec:
     return OK;
 }
 
+/* Find the IncapsulaListenerPolicy for the address the connection was
+ * accepted on, once, and keep it in the conn_config for its requests.
+ * The first entry that matches wins.
+ */
+static const incapsula_listener_t *resolve_listener(conn_rec *c)
+{
+    const incapsula_listener_t *listener;
+    incapsula_addr_t local;
+    apr_uint32_t v4, want;
+    int i;
+
+    if (!incapsula_listeners)
+        return NULL;
+
+    addr_from_sockaddr(&local, c->local_addr);
+    listener = (const incapsula_listener_t *) incapsula_listeners->elts;
+    for (i = 0; i < incapsula_listeners->nelts; ++i, ++listener) {
+        if (listener->port != c->local_addr->port)
+            continue;
+        if (listener->addr.family) {
+            /* Dual stack listeners see IPv4 peers as IPv4-mapped */
+            if (v4_addr(listener->addr.family, listener->addr.addr, &want)) {
+                if (!v4_addr(local.family, local.addr, &v4) || v4 != want)
+                    continue;
+            }
+            else if (local.family != listener->addr.family
+                     || memcmp(local.addr, listener->addr.addr, 16)) {
+                continue;
+            }
+        }
+        ap_set_module_config(c->conn_config, &incapsula_module,
+                             (void *) listener);
+        return listener;
+    }
+    return NULL;
+}
+
+#if !AP_MODULE_MAGIC_AT_LEAST(20120211,110)
+/* Was the connection accepted on a Listen port?  Without c->outgoing,
+ * this is how mod_proxy's backend connections are told apart: their
+ * local port is an ephemeral one.
+ */
+static int accepted_on_listener(const conn_rec *c)
+{
+    const ap_listen_rec *lr;
+
+    for (lr = ap_listeners; lr; lr = lr->next) {
+        if (lr->bind_addr && lr->bind_addr->port == c->local_addr->port)
+            return 1;
+    }
+    return 0;
+}
+#endif
+
+/* While early deny is on, reject connections from untrusted peers
+ * before any request is read (or TLS handshake done) on them.  Only
+ * the address based virtual host is known here, so this follows its
+ * DenyAllButIncapsula and trusted proxies.
+ *
+ * A rejected connection is only marked aborted: the remaining hooks,
+ * core_pre_connection's filters and mod_ssl's among them, still run,
+ * and the core then closes it without processing any request.
+ */
+static int incapsula_pre_connection(conn_rec *c, void *csd)
+{
+    incapsula_config_t *config;
+    const incapsula_listener_t *listener;
+    incapsula_addr_t peer;
+    int active;
+
+#if AP_MODULE_MAGIC_AT_LEAST(20120211,110)
+    /* mod_proxy's backend connections, whose peer is the backend */
+    if (c->outgoing)
+        return OK;
+#else
+    if (!accepted_on_listener(c))
+        return OK;
+#endif
+
+    listener = resolve_listener(c);
+
+    if (!incapsula_rate || !apr_atomic_read32(&incapsula_rate->active))
+        return OK;
+
+    config = ap_get_module_config(c->base_server->module_config,
+                                  &incapsula_module);
+    active = active_policy(config, listener);
+    if (active == IC_ACTIVE_OFF
+            || !(config->deny_all || active == IC_ACTIVE_STRICT))
+        return OK;
+
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    addr_from_sockaddr(&peer, c->client_addr);
+#else
+    addr_from_sockaddr(&peer, c->remote_addr);
+#endif
+    if (peer_verdict(config, &peer) != IC_MATCH_NONE)
+        return OK;
+
+    rate_note(c->base_server);
+    apr_atomic_inc32(&incapsula_stats.early_denied);
+    c->keepalive = AP_CONN_CLOSE;
+    c->aborted = 1;
+    return OK;
+}
+
+/* Replace the inbound client ip header with the single configured one
+ * for mod_proxy backends.  This runs at fixups, once mod_proxy or
+ * mod_rewrite has marked the request as proxied.
+ */
+static int incapsula_forward_fixup(request_rec *r)
+{
+    conn_rec *c = r->connection;
+    incapsula_config_t *config = (incapsula_config_t *)
+        ap_get_module_config(r->server->module_config, &incapsula_module);
+    incapsula_conn_t *conn;
+    const char *val;
+
+    incapsula_listener_t *listener =
+        ap_get_module_config(c->conn_config, &incapsula_module);
+
+    if (!r->proxyreq || active_policy(config, listener) == IC_ACTIVE_OFF
+            || !config->forward_header_name
+            || !*config->forward_header_name)
+        return DECLINED;
+
+    apr_pool_userdata_get((void*)&conn, "mod_incapsula-conn", c->pool);
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    if (!conn || c->client_addr != &conn->proxied_addr)
+        return DECLINED;
+#else
+    if (!conn || c->remote_addr != &conn->proxied_addr)
+        return DECLINED;
+#endif
+
+    if (config->forward_rfc7239) {
+        /* Once per connection; keepalive requests reuse it */
+        if (!conn->forwarded) {
+            conn->forwarded = conn->proxied_addr.family == APR_INET
+                ? apr_pstrcat(c->pool, "for=", conn->proxied_ip, NULL)
+                : apr_pstrcat(c->pool, "for=\"[", conn->proxied_ip, "]\"",
+                              NULL);
+        }
+        val = conn->forwarded;
+        apr_table_unset(r->headers_in, "X-Forwarded-For");
+    }
+    else {
+        val = conn->proxied_ip;
+    }
+
+    apr_table_unset(r->headers_in, config->header_name);
+    set_header(r->headers_in, config->forward_header_name,
+               config->forward_header_checksum, val);
+    return DECLINED;
+}
+
+/* The incapsula_classify optional functions; the matcher is fetched
+ * once per batch, so one batch always sees a single generation.
+ */
+static void incapsula_classify(server_rec *s, apr_sockaddr_t *const *addrs,
+                               int n, int *verdicts)
+{
+    incapsula_config_t *config = ap_get_module_config(s->module_config,
+                                                       &incapsula_module);
+    incapsula_matcher_t *matcher = config->matcher;
+    const apr_byte_t *addr[IC_BATCH];
+    int family[IC_BATCH];
+    int i, j;
+
+    if (!matcher) {
+        for (i = 0; i < n; ++i)
+            verdicts[i] = IC_MATCH_NONE;
+        return;
+    }
+
+    for (i = 0; i < n; i += IC_BATCH) {
+        int chunk = n - i < IC_BATCH ? n - i : IC_BATCH;
+
+        for (j = 0; j < chunk; ++j) {
+            family[j] = addrs[i + j]->family;
+            addr[j] = (const apr_byte_t *) addrs[i + j]->ipaddr_ptr;
+        }
+        matcher_classify(matcher, chunk, family, addr, verdicts + i);
+    }
+}
+
+static void incapsula_classify_addr(server_rec *s,
+                                    const incapsula_addr_t *addrs,
+                                    int n, int *verdicts)
+{
+    incapsula_config_t *config = ap_get_module_config(s->module_config,
+                                                       &incapsula_module);
+    incapsula_matcher_t *matcher = config->matcher;
+    const apr_byte_t *addr[IC_BATCH];
+    int family[IC_BATCH];
+    int i, j;
+
+    if (!matcher) {
+        for (i = 0; i < n; ++i)
+            verdicts[i] = IC_MATCH_NONE;
+        return;
+    }
+
+    for (i = 0; i < n; i += IC_BATCH) {
+        int chunk = n - i < IC_BATCH ? n - i : IC_BATCH;
+
+        for (j = 0; j < chunk; ++j) {
+            family[j] = addrs[i + j].family;
+            addr[j] = addrs[i + j].addr;
+        }
+        matcher_classify(matcher, chunk, family, addr, verdicts + i);
+    }
+}
+
+static const char *range_str(apr_pool_t *p, const incapsula_range_t *range)
+{
+    char buf[64];
+
+    if (!inet_ntop(range->family == APR_INET ? AF_INET : AF_INET6,
+                   range->addr, buf, sizeof(buf)))
+        return "?";
+    return apr_psprintf(p, "%s/%d", buf, range->bits);
+}
+
+static int incapsula_status_hook(request_rec *r, int flags)
+{
+    incapsula_config_t *config = ap_get_module_config(r->server->module_config,
+                                                       &incapsula_module);
+    incapsula_matcher_t *matcher = config->matcher;
+    incapsula_linear_t *linear = matcher ? matcher->linear : NULL;
+    const incapsula_proxymatch_t *match = linear
+        ? (const incapsula_proxymatch_t *) config->proxymatch_ip->elts : NULL;
+    int i;
+    apr_uint32_t requests = apr_atomic_read32(&incapsula_stats.requests);
+    apr_uint32_t fast_path = apr_atomic_read32(&incapsula_stats.fast_path);
+    apr_uint32_t peer_hits = apr_atomic_read32(&incapsula_stats.peer_hits);
+    apr_uint32_t peer_misses = apr_atomic_read32(&incapsula_stats.peer_misses);
+    apr_uint32_t denied = apr_atomic_read32(&incapsula_stats.denied);
+    apr_uint32_t denied_minimal =
+        apr_atomic_read32(&incapsula_stats.denied_minimal);
+    apr_uint32_t denied_abort = apr_atomic_read32(&incapsula_stats.denied_abort);
+    apr_uint32_t early_denied = apr_atomic_read32(&incapsula_stats.early_denied);
+    apr_uint32_t exempt = apr_atomic_read32(&incapsula_stats.exempt);
+    apr_uint32_t skipped = apr_atomic_read32(&incapsula_stats.skipped);
+    int early_active = incapsula_rate
+                     && apr_atomic_read32(&incapsula_rate->active);
+
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "IncapsulaRequests: %u\n", requests);
+        ap_rprintf(r, "IncapsulaSkipped: %u\n", skipped);
+        ap_rprintf(r, "IncapsulaFastPath: %u\n", fast_path);
+        ap_rprintf(r, "IncapsulaPeerCacheHits: %u\n", peer_hits);
+        ap_rprintf(r, "IncapsulaPeerCacheMisses: %u\n", peer_misses);
+        ap_rprintf(r, "IncapsulaDenied: %u\n", denied);
+        ap_rprintf(r, "IncapsulaDeniedMinimal: %u\n", denied_minimal);
+        ap_rprintf(r, "IncapsulaDeniedAbort: %u\n", denied_abort);
+        ap_rprintf(r, "IncapsulaEarlyDenied: %u\n", early_denied);
+        ap_rprintf(r, "IncapsulaExempt: %u\n", exempt);
+        ap_rprintf(r, "IncapsulaEarlyDenyActive: %d\n", early_active);
+        for (i = 0; linear && i < linear->nelts; ++i)
+            ap_rprintf(r, "IncapsulaProxyHits%d: %s %u\n", i,
+                       range_str(r->pool, &match[i].range),
+                       apr_atomic_read32(&linear->hits[i]));
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>mod_incapsula (this child)</h2>\n<dl>\n", r);
+    ap_rprintf(r, "<dt>Requests with client IP header: %u</dt>\n", requests);
+    ap_rprintf(r, "<dt>Requests to hosts with IncapsulaEngine Off: %u</dt>\n",
+               skipped);
+    ap_rprintf(r, "<dt>Single-hop IPv4 fast path: %u (%.1f%%)</dt>\n",
+               fast_path, requests ? 100.0 * fast_path / requests : 0.0);
+    ap_rprintf(r, "<dt>Peer verdict cache: %u hits, %u misses</dt>\n",
+               peer_hits, peer_misses);
+    ap_rprintf(r, "<dt>Denied, connection closed: %u "
+               "(%u minimal, %u aborted)</dt>\n",
+               denied, denied_minimal, denied_abort);
+    ap_rprintf(r, "<dt>Exempt from DenyAllButIncapsula: %u</dt>\n", exempt);
+    if (incapsula_rate)
+        ap_rprintf(r, "<dt>Early deny (all children): %s, %u connections "
+                   "rejected by this child</dt>\n",
+                   early_active ? "on" : "off", early_denied);
+    if (linear) {
+        ap_rprintf(r, "<dt>Trusted proxy hits, tested %s (%u reorderings):"
+                   "</dt>\n", linear->reorderable ? "most hit first"
+                                                   : "in config order",
+                   apr_atomic_read32(&linear->reorders));
+        for (i = 0; i < linear->nelts; ++i)
+            ap_rprintf(r, "<dd>%s: %u</dd>\n",
+                       range_str(r->pool, &match[i].range),
+                       apr_atomic_read32(&linear->hits[i]));
+    }
+    ap_rputs("</dl>\n", r);
+    return OK;
+}
+
+/* Resolve the trusted proxy host names into ranges, and into
+ * proxymatch (if given) for the linear engine.  Returns the name
+ * which failed to resolve, or NULL.
+ */
+static const char *resolve_hosts(apr_pool_t *p,
+                                 const apr_array_header_t *hosts,
+                                 apr_array_header_t *ranges,
+                                 apr_array_header_t *proxymatch,
+                                 apr_status_t *rv)
+{
+    const incapsula_host_t *host = (const incapsula_host_t *) hosts->elts;
+    int i;
+
+    for (i = 0; i < hosts->nelts; ++i) {
+        apr_sockaddr_t *temp_sa;
+
+        *rv = apr_sockaddr_info_get(&temp_sa, host[i].name, APR_UNSPEC, 0,
+                                    APR_IPV4_ADDR_OK, p);
+        if (*rv != APR_SUCCESS)
+            return host[i].name;
+
+        for (; temp_sa; temp_sa = temp_sa->next) {
+            incapsula_range_t *range;
+            char ip[64];
+
+            apr_sockaddr_ip_getbuf(ip, sizeof(ip), temp_sa);
+            range = (incapsula_range_t *) apr_array_push(ranges);
+            if (!parse_range(range, ip, NULL)) {
+                --ranges->nelts;
+                continue;
+            }
+            range->verdict = host[i].internal ? IC_MATCH_INTERNAL
+                                              : IC_MATCH_TRUSTED;
+            if (proxymatch) {
+                incapsula_proxymatch_t *match = (incapsula_proxymatch_t *)
+                    apr_array_push(proxymatch);
+                match->internal = host[i].internal;
+                match->range = *range;
+                if ((*rv = apr_ipsubnet_create(&match->ip, ip, NULL,
+                                               p)) != APR_SUCCESS)
+                    return host[i].name;
+            }
+        }
+    }
+    return NULL;
+}
+
+#if APR_HAS_THREADS
+
+typedef struct {
+    incapsula_config_t *config;
+    server_rec *s;
+    /** The pools of the swapped in matcher and of its predecessor,
+     *  which is only destroyed one more interval after being retired
+     */
+    apr_pool_t *current;
+    apr_pool_t *previous;
+} incapsula_resolve_job_t;
+
+typedef struct {
+    apr_pool_t *pool;
+    apr_thread_t *thread;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int stop;
+    apr_interval_time_t interval;
+    apr_array_header_t *jobs;
+} incapsula_resolver_t;
+
+static void refresh_matcher(incapsula_resolver_t *resolver,
+                            incapsula_resolve_job_t *job)
+{
+    incapsula_config_t *config = job->config;
+    incapsula_matcher_t *current = config->matcher;
+    incapsula_matcher_t *matcher;
+    apr_array_header_t *ranges;
+    const char *failed;
+    apr_status_t rv;
+    apr_pool_t *p;
+
+    apr_pool_create(&p, resolver->pool);
+    ranges = config->proxymatch_ranges
+           ? apr_array_copy(p, config->proxymatch_ranges)
+           : apr_array_make(p, 8, sizeof(incapsula_range_t));
+    failed = resolve_hosts(p, config->proxymatch_hosts, ranges, NULL, &rv);
+    if (failed) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, job->s,
+                     "RemoteIP: Could not resolve trusted proxy %s, "
+                     "keeping the previous addresses", failed);
+        apr_pool_destroy(p);
+        return;
+    }
+    if (config->exempt_ranges)
+        apr_array_cat(ranges, config->exempt_ranges);
+
+    /* Resolved ranges may change what auto selects; the linear engine
+     * never tests them (see compile_matcher)
+     */
+    matcher = build_matcher(p, ranges, config->engine == IC_ENGINE_LINEAR
+                                       ? IC_ENGINE_TRIE : config->engine);
+    if (matcher->nranges == current->nranges
+            && !memcmp(matcher->ranges, current->ranges,
+                       matcher->nranges * sizeof(incapsula_range_t))) {
+        apr_pool_destroy(p);
+        return;
+    }
+    matcher->generation = current->generation + 1;
+    apr_atomic_xchgptr((volatile void **) &config->matcher, matcher);
+
+    if (job->previous)
+        apr_pool_destroy(job->previous);
+    job->previous = job->current;
+    job->current = p;
+}
+
+static void * APR_THREAD_FUNC resolver_thread(apr_thread_t *thread, void *data)
+{
+    incapsula_resolver_t *resolver = (incapsula_resolver_t *) data;
+
+    apr_thread_mutex_lock(resolver->mutex);
+    while (!resolver->stop) {
+        incapsula_resolve_job_t *job;
+        int i;
+
+        apr_thread_mutex_unlock(resolver->mutex);
+        job = (incapsula_resolve_job_t *) resolver->jobs->elts;
+        for (i = 0; i < resolver->jobs->nelts && !resolver->stop; ++i)
+            refresh_matcher(resolver, &job[i]);
+        apr_thread_mutex_lock(resolver->mutex);
+
+        if (!resolver->stop)
+            apr_thread_cond_timedwait(resolver->cond, resolver->mutex,
+                                      resolver->interval);
+    }
+    apr_thread_mutex_unlock(resolver->mutex);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t resolver_stop(void *data)
+{
+    incapsula_resolver_t *resolver = (incapsula_resolver_t *) data;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(resolver->mutex);
+    resolver->stop = 1;
+    apr_thread_cond_signal(resolver->cond);
+    apr_thread_mutex_unlock(resolver->mutex);
+    apr_thread_join(&rv, resolver->thread);
+    return APR_SUCCESS;
+}
+
+/* Each child resolves the trusted proxy host names in a thread of its
+ * own, so a slow resolver never stalls startup or requests; until the
+ * first resolution completes those proxies are simply not trusted.
+ */
+static void incapsula_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    incapsula_config_t *base = ap_get_module_config(s->module_config,
+                                                     &incapsula_module);
+    incapsula_resolver_t *resolver;
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    server_rec *main_server = s;
+
+    if (!base->resolve_interval)
+        return;
+
+    resolver = apr_pcalloc(pchild, sizeof(*resolver));
+    resolver->interval = apr_time_from_sec(base->resolve_interval);
+    resolver->jobs = apr_array_make(pchild, 1, sizeof(incapsula_resolve_job_t));
+    for (; s; s = s->next) {
+        incapsula_config_t *config = ap_get_module_config(s->module_config,
+                                                           &incapsula_module);
+        incapsula_resolve_job_t *job;
+
+        if (!config->proxymatch_hosts || !config->matcher)
+            continue;
+        job = (incapsula_resolve_job_t *) apr_array_push(resolver->jobs);
+        job->config = config;
+        job->s = s;
+    }
+    if (!resolver->jobs->nelts)
+        return;
+
+    /* The resolver's pools get an allocator of their own, as they are
+     * created and destroyed outside of the request threads
+     */
+    apr_allocator_create(&allocator);
+    apr_pool_create_ex(&resolver->pool, pchild, NULL, allocator);
+    apr_allocator_owner_set(allocator, resolver->pool);
+
+    apr_thread_mutex_create(&resolver->mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
+    apr_thread_cond_create(&resolver->cond, pchild);
+    rv = apr_thread_create(&resolver->thread, NULL, resolver_thread,
+                           resolver, pchild);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, main_server,
+                     "RemoteIP: Could not create the trusted proxy "
+                     "resolver thread");
+        return;
+    }
+    /* Joined before pchild destroys its subpools, the thread's own
+     * and resolver->pool among them, which it may still be using
+     */
+    apr_pool_pre_cleanup_register(pchild, resolver, resolver_stop);
+}
+
+#endif /* APR_HAS_THREADS */
+
+static int incapsula_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                 apr_pool_t *ptemp, server_rec *s)
+{
+    incapsula_config_t *base = ap_get_module_config(s->module_config,
+                                                     &incapsula_module);
+    apr_hash_t *resolved = apr_hash_make(ptemp);
+    server_rec *vs;
+
+    for (vs = s; vs; vs = vs->next) {
+        incapsula_config_t *config = ap_get_module_config(vs->module_config,
+                                                           &incapsula_module);
+        const char *failed;
+        apr_status_t rv;
+
+        if (!config->proxymatch_hosts)
+            continue;
+
+        if (base->resolve_interval) {
+            /* Resolved by each child, into a compiled matcher */
+            config->ranges_only = 1;
+            if (!config->proxymatch_ranges)
+                config->proxymatch_ranges = apr_array_make(pconf, 8,
+                                                sizeof(incapsula_range_t));
+            continue;
+        }
+
+        if (apr_hash_get(resolved, &config->proxymatch_hosts,
+                         sizeof(config->proxymatch_hosts)))
+            continue;
+        apr_hash_set(resolved, apr_pmemdup(ptemp, &config->proxymatch_hosts,
+                                           sizeof(config->proxymatch_hosts)),
+                     sizeof(config->proxymatch_hosts), config);
+
+        if (!config->proxymatch_ranges)
+            config->proxymatch_ranges = apr_array_make(pconf, 8,
+                                            sizeof(incapsula_range_t));
+        failed = resolve_hosts(pconf, config->proxymatch_hosts,
+                               config->proxymatch_ranges,
+                               config->proxymatch_ip, &rv);
+        if (failed) {
+            ap_log_error(APLOG_MARK, APLOG_STARTUP|APLOG_ERR, rv, vs,
+                         "RemoteIP: Error parsing IP %s for "
+                         "IncapsulaRemoteIPTrustedProxy", failed);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    incapsula_listeners = base->listeners;
+    incapsula_rate = NULL;
+    early_deny_threshold = base->early_deny_threshold;
+    if (early_deny_threshold) {
+        apr_shm_t *shm;
+        apr_status_t rv = apr_shm_create(&shm, sizeof(incapsula_rate_t),
+                                         NULL, pconf);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_STARTUP|APLOG_ERR, rv, s,
+                         "RemoteIP: Could not create the shared memory "
+                         "for IncapsulaEarlyDenyThreshold");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        incapsula_rate = apr_shm_baseaddr_get(shm);
+        memset(incapsula_rate, 0, sizeof(*incapsula_rate));
+    }
+
+    compile_matcher(pconf, s, base);
+    for (vs = s->next; vs; vs = vs->next) {
+        incapsula_config_t *config = ap_get_module_config(vs->module_config,
+                                                           &incapsula_module);
+        if (config->proxymatch_ranges == base->proxymatch_ranges
+                && config->exempt_ranges == base->exempt_ranges
+                && config->engine == base->engine
+                && !(base->resolve_interval && config->proxymatch_hosts))
+            config->matcher = base->matcher;
+        else
+            compile_matcher(pconf, vs, config);
+    }
+    return OK;
+}
+
+static const char *const ic_engine_names[] = { "auto", "linear", "trie",
+                                               "vector", "eytzinger" };
+
+/* Describe the matcher of one server for the -t report, warning of
+ * lists left to the linear engine which are long enough to cost.
+ */
+static void report_matcher(apr_file_t *out, server_rec *s,
+                           incapsula_config_t *config, int verbose)
+{
+    incapsula_matcher_t *matcher = config->matcher;
+    int hosts = config->proxymatch_hosts ? config->proxymatch_hosts->nelts : 0;
+    int outer[129];
+    int depth = 0;
+    int nested = 0;
+    int maxbits = 0;
+    apr_size_t bytes;
+    int i;
+
+    if (!matcher) {
+        if (verbose)
+            apr_file_printf(out, "  %s:%u: no trusted proxies\n",
+                            s->server_hostname, s->port);
+        return;
+    }
+
+    /* Ranges overriding the verdict of a range enclosing them */
+    for (i = 0; i < matcher->nranges; ++i) {
+        while (depth && !range_contains(&matcher->ranges[outer[depth - 1]],
+                                        &matcher->ranges[i]))
+            --depth;
+        if (depth)
+            ++nested;
+        outer[depth++] = i;
+        if (matcher->ranges[i].bits > maxbits)
+            maxbits = matcher->ranges[i].bits;
+    }
+
+    bytes = (matcher->trie4.nelts + matcher->trie6.nelts)
+          * sizeof(incapsula_trie_node_t)
+          + matcher->nranges * sizeof(incapsula_range_t)
+          + (matcher->vset ? sizeof(incapsula_vset_t) : 0)
+          + (matcher->eytz ? (matcher->eytz->nelts + 1)
+                             * (2 * sizeof(apr_uint32_t) + 1) : 0)
+          + (matcher->hosts ? matcher->hosts->nbuckets * sizeof(apr_uint32_t)
+                              + matcher->hosts->nslots
+                                * (sizeof(incapsula_addr_t) + 1) : 0);
+    if (matcher->engine == IC_ENGINE_LINEAR) {
+        /* apr_ipsubnet_t is opaque; a family and two 16 byte masks */
+        bytes += config->proxymatch_ip->nelts
+               * (sizeof(incapsula_proxymatch_t) + 3 * sizeof(int) + 32);
+        if (config->proxymatch_ip->nelts > IC_LINEAR_MAX) {
+            apr_file_printf(out, "mod_incapsula: %s:%u tests %d trusted "
+                            "proxies one by one per request, consider "
+                            "IncapsulaMatcherEngine trie\n",
+                            s->server_hostname, s->port,
+                            config->proxymatch_ip->nelts);
+        }
+    }
+
+    if (!verbose)
+        return;
+
+    apr_file_printf(out, "  %s:%u:\n", s->server_hostname, s->port);
+    apr_file_printf(out, "    ranges: %d compiled, %d shadowed, %d merged, "
+                    "%d nested, %d host names%s\n",
+                    matcher->nranges, matcher->shadowed, matcher->merged,
+                    nested, hosts, hosts ? " (unresolved)" : "");
+    if (matcher->hosts)
+        apr_file_printf(out, "    hosts: %d in a perfect hash of %u slots\n",
+                        matcher->hosts->nelts, matcher->hosts->nslots);
+    if (matcher->engine == IC_ENGINE_LINEAR) {
+        apr_file_printf(out, "    engine: linear, %" APR_SIZE_T_FMT " bytes, "
+                        "up to %d tests per lookup\n",
+                        bytes, config->proxymatch_ip->nelts);
+    }
+    else if (matcher->engine == IC_ENGINE_EYTZINGER) {
+        apr_file_printf(out, "    engine: eytzinger, %" APR_SIZE_T_FMT
+                        " bytes, %d IPv4 intervals, IPv6 by trie\n",
+                        bytes, matcher->eytz->nelts);
+    }
+    else if (matcher->engine == IC_ENGINE_VECTOR) {
+        apr_file_printf(out, "    engine: vector (%s), %" APR_SIZE_T_FMT
+                        " bytes, %d IPv4 ranges tested per lane, IPv6 by "
+                        "trie\n", vset_kernel, bytes, matcher->vset->nelts);
+    }
+    else {
+        apr_file_printf(out, "    engine: %s, %" APR_SIZE_T_FMT " bytes, "
+                        "%d + %d nodes, up to %d node steps per lookup\n",
+                        ic_engine_names[matcher->engine], bytes,
+                        matcher->trie4.nelts, matcher->trie6.nelts, maxbits);
+    }
+}
+
+/* httpd -t compiles the matchers it would run with, warning of slow
+ * ones; httpd -t -D DUMP_INCAPSULA reports each of them in full.
+ */
+static void incapsula_test_config(apr_pool_t *pconf, server_rec *s)
+{
+    int verbose = ap_exists_config_define("DUMP_INCAPSULA");
+    apr_file_t *out = NULL;
+
+    apr_file_open_stdout(&out, pconf);
+    if (verbose)
+        apr_file_printf(out, "mod_incapsula trusted proxy matchers:\n");
+    for (; s; s = s->next) {
+        incapsula_config_t *config = ap_get_module_config(s->module_config,
+                                                           &incapsula_module);
+        if (!config->matcher)
+            compile_matcher(pconf, s, config);
+        report_matcher(out, s, config, verbose);
+    }
+}
+
+static const char *listener_policy_set(cmd_parms *cmd, void *dummy,
+                                       const char *arg, const char *policy)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    incapsula_listener_t *listener;
+    char *host;
+    char *scope;
+    apr_port_t port;
+
+    if (err)
+        return err;
+
+    if (apr_parse_addr_port(&host, &scope, &port, arg, cmd->temp_pool)
+            != APR_SUCCESS || !port || scope)
+        return apr_pstrcat(cmd->pool, cmd->cmd->name, " ", arg,
+                           ": expected [address:]port", NULL);
+
+    if (!config->listeners)
+        config->listeners = apr_array_make(cmd->pool, 2, sizeof(*listener));
+    listener = (incapsula_listener_t *) apr_array_push(config->listeners);
+    memset(listener, 0, sizeof(*listener));
+    listener->port = port;
+    if (host && strcmp(host, "*") && decode_hop(&listener->addr, host))
+        return apr_pstrcat(cmd->pool, cmd->cmd->name, " ", arg,
+                           ": the address must be a literal IP", NULL);
+
+    if (!strcasecmp(policy, "On"))
+        listener->policy = IC_ACTIVE_ON;
+    else if (!strcasecmp(policy, "Off"))
+        listener->policy = IC_ACTIVE_OFF;
+    else if (!strcasecmp(policy, "Strict"))
+        listener->policy = IC_ACTIVE_STRICT;
+    else
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " policy must be one of On, Off or Strict", NULL);
+    return NULL;
+}
+
+static const char *early_deny_threshold_set(cmd_parms *cmd, void *dummy,
+                                            const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+    config->early_deny_threshold = atoi(arg);
+    if (config->early_deny_threshold < 0 || !apr_isdigit(*arg))
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " must be a number of requests per second", NULL);
+    return NULL;
+}
+
+static const char *resolve_interval_set(cmd_parms *cmd, void *dummy,
+                                        const char *arg)
+{
+    incapsula_config_t *config = ap_get_module_config(cmd->server->module_config,
+                                                       &incapsula_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+#if APR_HAS_THREADS
+    config->resolve_interval = atoi(arg);
+    if (config->resolve_interval < 0 || !apr_isdigit(*arg))
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " must be a number of seconds", NULL);
+    return NULL;
+#else
+    return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                       " requires APR thread support", NULL);
+#endif
+}
+
 static const command_rec incapsula_cmds[] =
 {
+    AP_INIT_FLAG("IncapsulaEngine", active_set, NULL, RSRC_CONF,
+                 "Off to skip all processing for a virtual host not behind "
+                 "Incapsula; On (default)"),
+    AP_INIT_TAKE2("IncapsulaListenerPolicy", listener_policy_set, NULL,
+                  RSRC_CONF,
+                  "[address:]port of a Listen directive, and On, Off to skip "
+                  "all processing of its connections, or Strict to deny "
+                  "them as DenyAllButIncapsula does"),
     AP_INIT_TAKE1("IncapsulaRemoteIPHeader", header_name_set, NULL, RSRC_CONF,
                   "Specifies a request header to trust as the client IP, "
                   "Overrides the default of IC-Connecting-IP"),
+    AP_INIT_TAKE1("IncapsulaRemoteIPProxiesHeader", proxies_header_name_set,
+                  NULL, RSRC_CONF,
+                  "Specifies a request header to record the list of trusted "
+                  "proxies the client IP was presented by"),
+    AP_INIT_TAKE1("IncapsulaRemoveHeader", header_mode_set, NULL, RSRC_CONF,
+                  "What to do with the client IP header once processed; "
+                  "Off (default), On to remove it, or Replace to leave "
+                  "only the final client IP"),
+    AP_INIT_TAKE1("IncapsulaForwardHeader", forward_header_name_set,
+                  NULL, RSRC_CONF,
+                  "A single header to pass the client IP to mod_proxy "
+                  "backends in, Forwarded for RFC 7239, or Off (default)"),
     AP_INIT_ITERATE("IncapsulaRemoteIPTrustedProxy", proxies_set, 0, RSRC_CONF,
                     "Specifies one or more proxies which are trusted "
                     "to present IP headers. Overrides the defaults."),
+    AP_INIT_ITERATE("IncapsulaExemptSource", exempt_set, NULL, RSRC_CONF,
+                    "IP-address[/mask] of health check or monitoring "
+                    "sources let past DenyAllButIncapsula, but never "
+                    "trusted to name a client"),
+    AP_INIT_TAKE1("IncapsulaRemoteIPTrustedProxyList", proxylist_read, 0,
+                  RSRC_CONF,
+                  "The filename to read the list of trusted proxies from, "
+                  "see the IncapsulaRemoteIPTrustedProxy directive"),
+    AP_INIT_TAKE1("IncapsulaMatcherEngine", engine_set, NULL, RSRC_CONF,
+                  "How trusted proxies are matched; auto (default), "
+                  "linear, trie, vector or eytzinger"),
+    AP_INIT_TAKE1("IncapsulaRemoteIPResolveInterval", resolve_interval_set,
+                  NULL, RSRC_CONF,
+                  "Seconds between background resolutions of trusted proxy "
+                  "host names, or 0 (default) to resolve them at startup"),
     AP_INIT_NO_ARGS("DenyAllButIncapsula", deny_all_set, NULL, RSRC_CONF,
                     "Return a 403 status to all requests which do not originate from "
                     "a IncapsulaRemoteIPTrustedProxy."),
+    AP_INIT_TAKE1("IncapsulaEarlyDenyThreshold", early_deny_threshold_set,
+                  NULL, RSRC_CONF,
+                  "Untrusted peer requests per second past which "
+                  "DenyAllButIncapsula rejects untrusted connections "
+                  "before reading a request, or 0 (default) to never"),
+    AP_INIT_TAKE1("IncapsulaDenyMode", deny_mode_set, NULL, RSRC_CONF,
+                  "How DenyAllButIncapsula answers; 403 (default), Minimal "
+                  "for a fixed bodyless 403, or Abort to drop the "
+                  "connection unanswered"),
+    AP_INIT_FLAG("IncapsulaDenyShortLinger", deny_short_linger_set, NULL,
+                 RSRC_CONF,
+                 "On to skip the lingering close of connections denied by "
+                 "DenyAllButIncapsula"),
     { NULL }
 };
 
 static void register_hooks(apr_pool_t *p)
 {
+    select_vset_kernel();
+
     // We need to run very early so as to not trip up mod_security.
     // Hence, this little trick, as mod_security runs at APR_HOOK_REALLY_FIRST.
     ap_hook_post_read_request(incapsula_modify_connection, NULL, NULL, APR_HOOK_REALLY_FIRST - 10);
+    ap_hook_pre_connection(incapsula_pre_connection, NULL, NULL,
+                           APR_HOOK_REALLY_FIRST);
+    ap_hook_fixups(incapsula_forward_fixup, NULL, NULL, APR_HOOK_LAST);
+    ap_hook_post_config(incapsula_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_test_config(incapsula_test_config, NULL, NULL, APR_HOOK_MIDDLE);
+#if APR_HAS_THREADS
+    ap_hook_child_init(incapsula_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+#endif
+    APR_OPTIONAL_HOOK(ap, status_hook, incapsula_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
+    APR_REGISTER_OPTIONAL_FN(incapsula_classify);
+    APR_REGISTER_OPTIONAL_FN(incapsula_classify_addr);
 }
 
 module AP_MODULE_DECLARE_DATA incapsula_module = {
@@ -0,0 +1,74 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file  mod_incapsula.h
+ * @brief Trusted proxy classification exported by mod_incapsula
+ *
+ * Other modules retrieve these with APR_RETRIEVE_OPTIONAL_FN() after
+ * configuration, and must cope with them being NULL when mod_incapsula
+ * is not loaded.
+ */
+
+#ifndef MOD_INCAPSULA_H
+#define MOD_INCAPSULA_H
+
+#include "httpd.h"
+#include "apr_optional.h"
+#include "apr_network_io.h"
+
+/** Not a trusted proxy (or no trusted proxies are configured) */
+#define INCAPSULA_VERDICT_NONE      0
+/** An Incapsula edge or other external trusted proxy */
+#define INCAPSULA_VERDICT_TRUSTED   1
+/** An internal proxy */
+#define INCAPSULA_VERDICT_INTERNAL  2
+/** A health check or monitoring source, exempt from
+ *  DenyAllButIncapsula but not trusted to name a client
+ */
+#define INCAPSULA_VERDICT_EXEMPT    3
+
+/** A raw binary address */
+typedef struct {
+    /** APR_INET or APR_INET6 */
+    apr_byte_t family;
+    /** The address in network byte order, IPv4 in the leading four bytes */
+    apr_byte_t addr[16];
+} incapsula_addr_t;
+
+/**
+ * Classify a batch of addresses against the trusted proxies of a server
+ * @param s The server whose trusted proxy list applies
+ * @param addrs The addresses to classify
+ * @param n The number of addresses
+ * @param verdicts Receives an INCAPSULA_VERDICT_* per address
+ */
+APR_DECLARE_OPTIONAL_FN(void, incapsula_classify,
+                        (server_rec *s, apr_sockaddr_t *const *addrs,
+                         int n, int *verdicts));
+
+/**
+ * Classify a batch of raw binary addresses, as incapsula_classify()
+ * @param s The server whose trusted proxy list applies
+ * @param addrs The addresses to classify
+ * @param n The number of addresses
+ * @param verdicts Receives an INCAPSULA_VERDICT_* per address
+ */
+APR_DECLARE_OPTIONAL_FN(void, incapsula_classify_addr,
+                        (server_rec *s, const incapsula_addr_t *addrs,
+                         int n, int *verdicts));
+
+#endif /* MOD_INCAPSULA_H */
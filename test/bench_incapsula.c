@@ -0,0 +1,215 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Timings of the post_read_request hook by header length, and of each
+ * matcher engine against the apr_ipsubnet_test() loop by list size;
+ * see the Makefile to build and run it.
+ */
+
+#include "incapsula_test.h"
+
+/* A small PRNG, so that runs are comparable */
+static apr_uint32_t rnd_state = 2463534242u;
+
+static apr_uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* Where timed loops leave their result, so that they are not elided */
+static volatile int sink;
+
+static double ns_per(apr_time_t start, long n)
+{
+    return (double) (apr_time_now() - start) * 1000.0 / n;
+}
+
+/* The whole hook for a client behind 1 to 32 trusted proxies, each
+ * request on a fresh connection so that no walk is recycled
+ */
+static void bench_walk(void)
+{
+    static const char *const trusted[] = { "198.51.100.0/24", NULL };
+    static const int hops[] = { 1, 2, 4, 8, 16, 32 };
+    static const int engines[] = { IC_ENGINE_LINEAR, IC_ENGINE_AUTO };
+    const long n = 200000;
+    int e, k;
+
+    printf("post_read_request, ns per request\n%-8s%12s%12s\n", "hops",
+           "linear", "auto");
+
+    for (k = 0; k < (int) (sizeof(hops) / sizeof(hops[0])); ++k) {
+        char *header = apr_pstrdup(test_pool, "203.0.113.7");
+        int i;
+
+        for (i = 1; i < hops[k]; ++i)
+            header = apr_psprintf(test_pool, "%s, 198.51.100.%d", header, i);
+
+        printf("%-8d", hops[k]);
+        for (e = 0; e < (int) (sizeof(engines) / sizeof(engines[0])); ++e) {
+            server_rec *s = test_proxies(trusted, engines[e]);
+            apr_pool_t *p;
+            apr_time_t start;
+            long j;
+
+            apr_pool_create(&p, test_pool);
+            start = apr_time_now();
+            for (j = 0; j < n; ++j) {
+                conn_rec *c = test_conn(p, s, "198.51.100.200");
+
+                incapsula_modify_connection(test_request(p, c, header));
+                apr_pool_clear(p);
+            }
+            printf("%12.0f", ns_per(start, n));
+            apr_pool_destroy(p);
+        }
+        printf("\n");
+    }
+}
+
+/* IPv4 lookups against random lists of /16 to /32 ranges; half of the
+ * addresses looked up fall within the listed ranges
+ */
+static void bench_match(void)
+{
+    static const int sizes[] = { 16, 256, 4096, 50000 };
+    static const int engines[] = {
+        IC_ENGINE_TRIE, IC_ENGINE_VECTOR, IC_ENGINE_EYTZINGER
+    };
+    const int naddrs = 1 << 16;
+    const long n = 2000000;
+    int k, e;
+
+    printf("\nIPv4 lookup, ns per address\n%-8s%12s", "ranges", "apr");
+    for (e = 0; e < (int) (sizeof(engines) / sizeof(engines[0])); ++e)
+        printf("%12s", ic_engine_names[engines[e]]);
+    printf("\n");
+
+    for (k = 0; k < (int) (sizeof(sizes) / sizeof(sizes[0])); ++k) {
+        apr_pool_t *p;
+        apr_array_header_t *ranges;
+        apr_ipsubnet_t **subnets;
+        apr_sockaddr_t **sas;
+        apr_byte_t (*addrs)[4];
+        apr_time_t start;
+        int want = 0, got;
+        long i, rounds;
+        int j;
+
+        apr_pool_create(&p, test_pool);
+        ranges = apr_array_make(p, sizes[k], sizeof(incapsula_range_t));
+        subnets = apr_palloc(p, sizes[k] * sizeof(*subnets));
+        for (j = 0; j < sizes[k]; ++j) {
+            apr_uint32_t r = rnd();
+            char *ip = apr_psprintf(p, "%u.%u.%u.%u", 1 + r % 223,
+                                    (r >> 8) % 256, (r >> 16) % 256,
+                                    rnd() % 256);
+            char *bits = apr_psprintf(p, "%u", 16 + (r >> 24) % 17);
+            incapsula_range_t *range = apr_array_push(ranges);
+
+            parse_range(range, ip, bits);
+            range->verdict = IC_MATCH_TRUSTED;
+            apr_ipsubnet_create(&subnets[j], ip, bits, p);
+        }
+
+        sas = apr_palloc(p, naddrs * sizeof(*sas));
+        addrs = apr_palloc(p, naddrs * sizeof(*addrs));
+        for (j = 0; j < naddrs; ++j) {
+            incapsula_range_t *range = &APR_ARRAY_IDX(ranges,
+                rnd() % sizes[k], incapsula_range_t);
+            apr_uint32_t a = rnd();
+            char ip[16];
+
+            if (j % 2) {
+                apr_uint32_t base;
+
+                memcpy(&base, range->addr, 4);
+                a = ntohl(base) | (a >> range->bits >> (range->bits == 32));
+            }
+            a = htonl(a);
+            memcpy(addrs[j], &a, 4);
+            apr_snprintf(ip, sizeof(ip), "%u.%u.%u.%u", addrs[j][0],
+                         addrs[j][1], addrs[j][2], addrs[j][3]);
+            sas[j] = test_sockaddr(p, ip);
+        }
+
+        /* The apr_ipsubnet_test() loop is O(n), so it gets fewer rounds */
+        rounds = n / sizes[k] < 4096 ? 4096 : n / sizes[k];
+        start = apr_time_now();
+        for (i = 0; i < rounds; ++i) {
+            for (j = 0; j < sizes[k]; ++j) {
+                if (apr_ipsubnet_test(subnets[j], sas[i % naddrs])) {
+                    ++want;
+                    break;
+                }
+            }
+        }
+        printf("%-8d%12.0f", sizes[k], ns_per(start, rounds));
+        sink = want;
+
+        want = 0;
+        for (j = 0; j < naddrs; ++j) {
+            for (i = 0; i < sizes[k]; ++i) {
+                if (apr_ipsubnet_test(subnets[i], sas[j])) {
+                    ++want;
+                    break;
+                }
+            }
+        }
+
+        for (e = 0; e < (int) (sizeof(engines) / sizeof(engines[0])); ++e) {
+            incapsula_matcher_t *matcher = build_matcher(p, ranges,
+                                                         engines[e]);
+
+            if (matcher->engine != engines[e]) {
+                printf("%12s", "-");
+                continue;
+            }
+            got = 0;
+            for (j = 0; j < naddrs; ++j)
+                got += matcher_lookup_addr(matcher, APR_INET,
+                                           addrs[j]) != IC_MATCH_NONE;
+            if (got != want) {
+                printf("\n%s matched %d addresses, apr_ipsubnet_test %d\n",
+                       ic_engine_names[engines[e]], got, want);
+                exit(1);
+            }
+
+            got = 0;
+            start = apr_time_now();
+            for (i = 0; i < n; ++i)
+                got += matcher_lookup_addr(matcher, APR_INET,
+                                           addrs[i % naddrs]);
+            printf("%12.1f", ns_per(start, n));
+            sink = got;
+        }
+        printf("\n");
+        apr_pool_destroy(p);
+    }
+}
+
+int main(void)
+{
+    test_init();
+
+    bench_walk();
+    bench_match();
+    return 0;
+}
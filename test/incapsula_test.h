@@ -0,0 +1,267 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Shared by the standalone drivers in this directory: mod_incapsula.c
+ * is compiled into each driver itself, against the headers of an
+ * installed httpd, and the few httpd core functions it calls are
+ * stubbed below, so only APR and APR-util are linked.  Servers,
+ * connections and requests are built by hand, just far enough for the
+ * module's hooks and directive handlers.
+ */
+
+#ifndef INCAPSULA_TEST_H
+#define INCAPSULA_TEST_H
+
+#include "../mod_incapsula.c"
+
+#include "apr_general.h"
+
+#include <stdio.h>
+
+/* httpd core functions the module links against */
+
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index,
+                               int level, apr_status_t status,
+                               const server_rec *s, const char *fmt, ...)
+{
+}
+
+AP_DECLARE(void) ap_log_rerror_(const char *file, int line, int module_index,
+                                int level, apr_status_t status,
+                                const request_rec *r, const char *fmt, ...)
+{
+}
+
+AP_DECLARE_NONSTD(int) ap_rprintf(request_rec *r, const char *fmt, ...)
+{
+    return 0;
+}
+
+AP_DECLARE(int) ap_rwrite(const void *buf, int nbyte, request_rec *r)
+{
+    return nbyte;
+}
+
+AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *filter,
+                                         apr_bucket_brigade *bb)
+{
+    return APR_SUCCESS;
+}
+
+AP_DECLARE(const char *) ap_check_cmd_context(cmd_parms *cmd,
+                                              unsigned forbidden)
+{
+    return NULL;
+}
+
+AP_DECLARE(int) ap_exists_config_define(const char *name)
+{
+    return 0;
+}
+
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname)
+{
+    return apr_pstrdup(p, fname);
+}
+
+AP_DECLARE(apr_status_t) ap_pcfg_openfile(ap_configfile_t **ret_cfg,
+                                          apr_pool_t *p, const char *name)
+{
+    return APR_ENOENT;
+}
+
+AP_DECLARE(apr_status_t) ap_cfg_getline(char *buf, apr_size_t bufsize,
+                                        ap_configfile_t *cfp)
+{
+    return APR_EOF;
+}
+
+AP_DECLARE(int) ap_cfg_closefile(ap_configfile_t *cfp)
+{
+    return 0;
+}
+
+AP_DECLARE(void) ap_hook_post_read_request(ap_HOOK_post_read_request_t *pf,
+                                           const char * const *aszPre,
+                                           const char * const *aszSucc,
+                                           int nOrder)
+{
+}
+
+AP_DECLARE(void) ap_hook_pre_connection(ap_HOOK_pre_connection_t *pf,
+                                        const char * const *aszPre,
+                                        const char * const *aszSucc,
+                                        int nOrder)
+{
+}
+
+AP_DECLARE(void) ap_hook_fixups(ap_HOOK_fixups_t *pf,
+                                const char * const *aszPre,
+                                const char * const *aszSucc, int nOrder)
+{
+}
+
+AP_DECLARE(void) ap_hook_post_config(ap_HOOK_post_config_t *pf,
+                                     const char * const *aszPre,
+                                     const char * const *aszSucc, int nOrder)
+{
+}
+
+AP_DECLARE(void) ap_hook_test_config(ap_HOOK_test_config_t *pf,
+                                     const char * const *aszPre,
+                                     const char * const *aszSucc, int nOrder)
+{
+}
+
+AP_DECLARE(void) ap_hook_child_init(ap_HOOK_child_init_t *pf,
+                                    const char * const *aszPre,
+                                    const char * const *aszSucc, int nOrder)
+{
+}
+
+/* Fixtures */
+
+static apr_pool_t *test_pool;
+
+static void test_init(void)
+{
+    apr_initialize();
+    atexit(apr_terminate);
+    apr_pool_create(&test_pool, NULL);
+    incapsula_module.module_index = 0;
+    select_vset_kernel();
+}
+
+/* A server with the given config, or a fresh one without the default
+ * Incapsula ranges, so that each test lists exactly the proxies it uses
+ */
+static server_rec *test_server(incapsula_config_t *config)
+{
+    server_rec *s = apr_pcalloc(test_pool, sizeof(*s));
+
+    if (!config) {
+        config = apr_pcalloc(test_pool, sizeof(*config));
+        config->header_name = IC_DEFAULT_IP_HEADER;
+    }
+    s->server_hostname = "test";
+    s->module_config = apr_pcalloc(test_pool, sizeof(void *));
+    ap_set_module_config(s->module_config, &incapsula_module, config);
+    return s;
+}
+
+static incapsula_config_t *test_config(server_rec *s)
+{
+    return ap_get_module_config(s->module_config, &incapsula_module);
+}
+
+/* Run a TAKE1 or ITERATE directive handler for the server */
+static const char *test_directive(server_rec *s,
+                                  const char *(*handler)(cmd_parms *, void *,
+                                                         const char *),
+                                  void *data, const char *arg)
+{
+    static const command_rec cmd_rec = { "IncapsulaTest" };
+    cmd_parms cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.pool = test_pool;
+    cmd.temp_pool = test_pool;
+    cmd.server = s;
+    cmd.cmd = &cmd_rec;
+    return handler(&cmd, data, arg);
+}
+
+/* A server trusting the given proxies, compiled for engine */
+static server_rec *test_proxies(const char *const *proxies, int engine)
+{
+    server_rec *s = test_server(NULL);
+    incapsula_config_t *config = test_config(s);
+
+    for (; *proxies; ++proxies) {
+        const char *err = test_directive(s, proxies_set, NULL, *proxies);
+
+        if (err) {
+            fprintf(stderr, "%s\n", err);
+            exit(2);
+        }
+    }
+    config->engine = engine;
+    compile_matcher(test_pool, s, config);
+    return s;
+}
+
+static apr_sockaddr_t *test_sockaddr(apr_pool_t *p, const char *ip)
+{
+    apr_sockaddr_t *sa;
+
+    if (apr_sockaddr_info_get(&sa, ip, APR_UNSPEC, 80, APR_IPV4_ADDR_OK,
+                              p) != APR_SUCCESS) {
+        fprintf(stderr, "cannot parse %s\n", ip);
+        exit(2);
+    }
+    return sa;
+}
+
+/* A connection from peer, with its pool */
+static conn_rec *test_conn(apr_pool_t *p, server_rec *s, const char *peer)
+{
+    conn_rec *c = apr_pcalloc(p, sizeof(*c));
+
+    c->pool = p;
+    c->base_server = s;
+    c->conn_config = apr_pcalloc(p, sizeof(void *));
+    c->notes = apr_table_make(p, 4);
+    c->keepalive = AP_CONN_UNKNOWN;
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    c->client_addr = test_sockaddr(p, peer);
+    apr_sockaddr_ip_get(&c->client_ip, c->client_addr);
+#else
+    c->remote_addr = test_sockaddr(p, peer);
+    apr_sockaddr_ip_get(&c->remote_ip, c->remote_addr);
+#endif
+    return c;
+}
+
+/* A request on c presenting header as the client ip header, if any */
+static request_rec *test_request(apr_pool_t *p, conn_rec *c,
+                                 const char *header)
+{
+    request_rec *r = apr_pcalloc(p, sizeof(*r));
+
+    r->pool = p;
+    r->connection = c;
+    r->server = c->base_server;
+    r->proto_num = HTTP_VERSION(1,1);
+    r->headers_in = apr_table_make(p, 8);
+    r->subprocess_env = apr_table_make(p, 8);
+    r->notes = apr_table_make(p, 4);
+    if (header)
+        apr_table_setn(r->headers_in, test_config(r->server)->header_name,
+                       header);
+    return r;
+}
+
+static const char *test_client_ip(const conn_rec *c)
+{
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    return c->client_ip;
+#else
+    return c->remote_ip;
+#endif
+}
+
+#endif /* INCAPSULA_TEST_H */
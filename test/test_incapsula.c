@@ -0,0 +1,658 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The header walk of incapsula_modify_connection() checked against
+ * mod_remoteip's, for every matcher engine, on fixed cases and on
+ * random proxy chains; see the Makefile to build and run it.
+ */
+
+#include "incapsula_test.h"
+
+static int tests;
+static int failures;
+
+#define CHECK(cond, ...) do {                                           \
+    ++tests;                                                            \
+    if (!(cond)) {                                                      \
+        ++failures;                                                     \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);                     \
+        printf(__VA_ARGS__);                                            \
+        printf("\n");                                                   \
+    }                                                                   \
+} while (0)
+
+static const int engines[] = {
+    IC_ENGINE_LINEAR, IC_ENGINE_TRIE, IC_ENGINE_VECTOR, IC_ENGINE_EYTZINGER
+};
+#define NENGINES (int) (sizeof(engines) / sizeof(engines[0]))
+
+typedef struct {
+    /** The hook's return value */
+    int status;
+    /** The client ip the connection ends up with */
+    const char *client_ip;
+    /** The superseded trusted proxies, or NULL */
+    const char *proxy_ips;
+} walk_t;
+
+static int str_eq(const char *a, const char *b)
+{
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+/* mod_remoteip's walk as in httpd 2.4, over the same proxymatch_ip list,
+ * except that hops must be literal addresses (mod_incapsula never
+ * resolves header values) and that an untrusted peer is denied under
+ * DenyAllButIncapsula.
+ */
+static walk_t remoteip_walk(apr_pool_t *p, const incapsula_config_t *config,
+                            const char *peer, const char *header)
+{
+    const incapsula_proxymatch_t *match =
+        (const incapsula_proxymatch_t *) config->proxymatch_ip->elts;
+    apr_sockaddr_t *sa = test_sockaddr(p, peer);
+    char *remote = header ? apr_pstrdup(p, header) : NULL;
+    char *client_ip;
+    walk_t walk = { OK, NULL, NULL };
+    int walked = 0;
+
+    apr_sockaddr_ip_get(&client_ip, sa);
+    walk.client_ip = client_ip;
+    if (!remote) {
+        if (config->deny_all)
+            walk.status = HTTP_FORBIDDEN;
+        return walk;
+    }
+
+    while (remote) {
+        char *parse_remote;
+        char *eos;
+        void *internal = NULL;
+        int trusted = 0;
+        unsigned char buf[16];
+        apr_sockaddr_t *next;
+        int i;
+
+        for (i = 0; i < config->proxymatch_ip->nelts; ++i) {
+            if (apr_ipsubnet_test(match[i].ip, sa)) {
+                internal = match[i].internal;
+                trusted = 1;
+                break;
+            }
+        }
+        if (!trusted) {
+            if (config->deny_all && !walked)
+                walk.status = HTTP_FORBIDDEN;
+            break;
+        }
+
+        if ((parse_remote = strrchr(remote, ',')) == NULL) {
+            parse_remote = remote;
+            remote = NULL;
+        }
+        else {
+            *(parse_remote++) = '\0';
+        }
+        while (*parse_remote == ' ')
+            ++parse_remote;
+        eos = parse_remote + strlen(parse_remote) - 1;
+        while (eos >= parse_remote && *eos == ' ')
+            *(eos--) = '\0';
+        if (eos < parse_remote)
+            break;
+
+        if (inet_pton(AF_INET, parse_remote, buf) != 1
+                && inet_pton(AF_INET6, parse_remote, buf) != 1)
+            break;
+        next = test_sockaddr(p, parse_remote);
+
+        if (!internal
+              && ((next->family == APR_INET
+                   && (((unsigned char *) next->ipaddr_ptr)[0] == 10
+                    || ((unsigned char *) next->ipaddr_ptr)[0] == 127
+                    || (((unsigned char *) next->ipaddr_ptr)[0] == 169
+                        && ((unsigned char *) next->ipaddr_ptr)[1] == 254)
+                    || (((unsigned char *) next->ipaddr_ptr)[0] == 172
+                        && (((unsigned char *) next->ipaddr_ptr)[1] & 0xf0)
+                           == 16)
+                    || (((unsigned char *) next->ipaddr_ptr)[0] == 192
+                        && ((unsigned char *) next->ipaddr_ptr)[1] == 168)))
+#if APR_HAVE_IPV6
+               || (next->family == APR_INET6
+                   && (((unsigned char *) next->ipaddr_ptr)[0] & 0xe0)
+                      != 0x20)
+#endif
+               ))
+            break;
+
+        if (!internal)
+            walk.proxy_ips = walk.proxy_ips
+                ? apr_pstrcat(p, walk.proxy_ips, ", ", walk.client_ip, NULL)
+                : walk.client_ip;
+        sa = next;
+        apr_sockaddr_ip_get(&client_ip, sa);
+        walk.client_ip = client_ip;
+        ++walked;
+    }
+    return walk;
+}
+
+static walk_t incapsula_walk(apr_pool_t *p, server_rec *s, const char *peer,
+                             const char *header)
+{
+    conn_rec *c = test_conn(p, s, peer);
+    request_rec *r = test_request(p, c, header);
+    walk_t walk;
+
+    walk.status = incapsula_modify_connection(r);
+    walk.client_ip = test_client_ip(c);
+    walk.proxy_ips = apr_table_get(r->notes, "incapsula-proxy-ip-list");
+    return walk;
+}
+
+static void check_walk(server_rec *s, int engine, const char *peer,
+                       const char *header)
+{
+    apr_pool_t *p;
+    walk_t got, want;
+
+    apr_pool_create(&p, test_pool);
+    got = incapsula_walk(p, s, peer, header);
+    want = remoteip_walk(p, test_config(s), peer, header);
+    CHECK(got.status == want.status
+              && str_eq(got.client_ip, want.client_ip)
+              && str_eq(got.proxy_ips, want.proxy_ips),
+          "engine %s, peer %s, header \"%s\": got %d %s [%s], "
+          "mod_remoteip %d %s [%s]", ic_engine_names[engine], peer,
+          header ? header : "(none)", got.status, got.client_ip,
+          got.proxy_ips ? got.proxy_ips : "", want.status, want.client_ip,
+          want.proxy_ips ? want.proxy_ips : "");
+    apr_pool_destroy(p);
+}
+
+static const char *const proxies[] = {
+    "199.83.128.0/21", "198.143.32.0/19", "2a02:e980::/29", NULL
+};
+
+/* header walks every engine must agree with mod_remoteip on */
+static const char *const cases[][2] = {
+    /* single hop, the fast path */
+    { "199.83.128.1", "1.2.3.4" },
+    { "199.83.128.1", " 1.2.3.4 " },
+    /* untrusted peer */
+    { "8.8.8.8", "1.2.3.4" },
+    { "8.8.8.8", "1.2.3.4, 199.83.128.1" },
+    /* several trusted hops */
+    { "199.83.128.1", "1.2.3.4, 198.143.32.7, 199.83.130.9" },
+    /* untrusted middle hop: the walk stops at it */
+    { "199.83.128.1", "1.2.3.4, 8.8.4.4, 198.143.32.7" },
+    /* private hops, never accepted from external proxies */
+    { "199.83.128.1", "10.1.2.3" },
+    { "199.83.128.1", "1.2.3.4, 192.168.0.1" },
+    { "199.83.128.1", "1.2.3.4, 172.16.5.4, 198.143.32.7" },
+    /* unparsable and empty hops */
+    { "199.83.128.1", "not-an-ip" },
+    { "199.83.128.1", "1.2.3.4, 1.2.3.4.5" },
+    { "199.83.128.1", "1.2.3.4, " },
+    { "199.83.128.1", "1.2.3.4,,198.143.32.7" },
+    { "199.83.128.1", "" },
+    { "199.83.128.1", " , " },
+    { "199.83.128.1", "1.2.3" },
+    /* IPv6 hops and peers */
+    { "199.83.128.1", "2001:db8::1" },
+    { "199.83.128.1", "2001:db8::1, 2a02:e980::5" },
+    { "2a02:e980::1", "1.2.3.4" },
+    { "2a02:e980::1", "2001:0db8:0000::0001" },
+    { "2a02:e980::1", "fe80::1" },
+    { "2001:db8::99", "1.2.3.4" },
+    /* IPv4-mapped peers and hops */
+    { "::ffff:199.83.128.1", "1.2.3.4" },
+    { "::ffff:199.83.128.1", "1.2.3.4, 198.143.32.7" },
+    { "::ffff:198.51.100.5", "1.2.3.4" },
+    { "::ffff:8.8.8.8", "1.2.3.4" },
+    { "199.83.128.1", "::ffff:1.2.3.4" },
+    /* no header at all */
+    { "199.83.128.1", NULL },
+    { "8.8.8.8", NULL },
+};
+
+static void test_cases(void)
+{
+    int e, deny_all, i;
+
+    for (e = 0; e < NENGINES; ++e) {
+        server_rec *s = test_proxies(proxies, engines[e]);
+        incapsula_config_t *config = test_config(s);
+
+        CHECK(config->matcher->engine == engines[e],
+              "engine %s compiled as %s", ic_engine_names[engines[e]],
+              ic_engine_names[config->matcher->engine]);
+        for (deny_all = 0; deny_all < 2; ++deny_all) {
+            config->deny_all = deny_all;
+            for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); ++i)
+                check_walk(s, engines[e], cases[i][0], cases[i][1]);
+        }
+    }
+}
+
+/* IPv4-mapped ranges can only be bulk loaded (apr_ipsubnet_create()
+ * refuses them), and must then cover mapped peers in the header walk
+ * just as in peer_verdict(), whichever engine compiled them
+ */
+static void test_mapped_range(void)
+{
+    static const int compiled[] = {
+        IC_ENGINE_TRIE, IC_ENGINE_VECTOR, IC_ENGINE_EYTZINGER
+    };
+    int e;
+
+    for (e = 0; e < (int) (sizeof(compiled) / sizeof(compiled[0])); ++e) {
+        server_rec *s = test_server(NULL);
+        incapsula_config_t *config = test_config(s);
+        apr_pool_t *p;
+        incapsula_addr_t addr;
+        walk_t walk;
+
+        push_range(test_pool, config, "199.83.128.0", "21",
+                   IC_MATCH_TRUSTED);
+        push_range(test_pool, config, "::ffff:203.0.113.0", "120",
+                   IC_MATCH_TRUSTED);
+        config->ranges_only = 1;
+        config->engine = compiled[e];
+        compile_matcher(test_pool, s, config);
+
+        apr_pool_create(&p, test_pool);
+        decode_hop(&addr, "::ffff:203.0.113.5");
+        walk = incapsula_walk(p, s, "::ffff:203.0.113.5", "1.2.3.4, 5.6.7.8");
+        CHECK(peer_verdict(config, &addr) == IC_MATCH_TRUSTED
+                  && !strcmp(walk.client_ip, "5.6.7.8"),
+              "engine %s: mapped peer in an IPv6 range walked to %s",
+              ic_engine_names[config->matcher->engine], walk.client_ip);
+        apr_pool_destroy(p);
+    }
+}
+
+/* Denied untrusted peers have their connection closed, trusted ones
+ * without the header keep it; exempt peers pass untranslated
+ */
+static void test_deny(void)
+{
+    server_rec *s = test_proxies(proxies, IC_ENGINE_AUTO);
+    incapsula_config_t *config = test_config(s);
+    apr_pool_t *p;
+    conn_rec *c;
+    request_rec *r;
+
+    config->deny_all = 1;
+    test_directive(s, exempt_set, NULL, "192.0.2.0/24");
+    compile_matcher(test_pool, s, config);
+
+    apr_pool_create(&p, test_pool);
+    c = test_conn(p, s, "8.8.8.8");
+    r = test_request(p, c, "1.2.3.4");
+    CHECK(incapsula_modify_connection(r) == HTTP_FORBIDDEN
+              && c->keepalive == AP_CONN_CLOSE,
+          "untrusted peer not denied with a close");
+
+    c = test_conn(p, s, "199.83.128.1");
+    r = test_request(p, c, NULL);
+    CHECK(incapsula_modify_connection(r) == HTTP_FORBIDDEN
+              && c->keepalive != AP_CONN_CLOSE,
+          "trusted peer without header not given a plain 403");
+
+    c = test_conn(p, s, "192.0.2.9");
+    r = test_request(p, c, "1.2.3.4");
+    CHECK(incapsula_modify_connection(r) == OK
+              && !strcmp(test_client_ip(c), "192.0.2.9"),
+          "exempt peer denied or translated");
+
+    c = test_conn(p, s, "192.0.2.9");
+    r = test_request(p, c, NULL);
+    CHECK(incapsula_modify_connection(r) == OK, "exempt peer denied");
+
+    /* The cheap deny modes are for HTTP/1.x only */
+    config->deny_mode = IC_DENY_ABORT;
+    c = test_conn(p, s, "8.8.8.8");
+    r = test_request(p, c, "1.2.3.4");
+    CHECK(incapsula_modify_connection(r) == DONE && c->aborted,
+          "untrusted peer not aborted");
+
+    c = test_conn(p, s, "8.8.8.8");
+    r = test_request(p, c, "1.2.3.4");
+    r->proto_num = HTTP_VERSION(2,0);
+    CHECK(incapsula_modify_connection(r) == HTTP_FORBIDDEN && !c->aborted,
+          "HTTP/2 request aborted instead of given a plain 403");
+
+    config->deny_mode = IC_DENY_MINIMAL;
+    c = test_conn(p, s, "8.8.8.8");
+    r = test_request(p, c, "1.2.3.4");
+    r->proto_num = HTTP_VERSION(2,0);
+    CHECK(incapsula_modify_connection(r) == HTTP_FORBIDDEN && !c->aborted,
+          "HTTP/2 request given the minimal response instead of a 403");
+    apr_pool_destroy(p);
+}
+
+/* Global exemptions and trusted proxies reach virtual hosts */
+static void test_merge(void)
+{
+    incapsula_config_t *global = create_incapsula_server_config(test_pool,
+                                                                NULL);
+    server_rec *main_server = test_server(global);
+    server_rec *vhost;
+    incapsula_config_t *config;
+    incapsula_addr_t addr;
+
+    test_directive(main_server, exempt_set, NULL, "192.0.2.0/24");
+    test_directive(main_server, proxies_set, NULL, "198.51.100.0/24");
+    global->deny_all = 1;
+
+    config = merge_incapsula_server_config(test_pool, global,
+                 create_incapsula_server_config(test_pool, NULL));
+    vhost = test_server(config);
+    compile_matcher(test_pool, vhost, config);
+
+    decode_hop(&addr, "192.0.2.9");
+    CHECK(config->deny_all && proxy_verdict(config, &addr) == IC_MATCH_EXEMPT,
+          "global exemption not inherited");
+    decode_hop(&addr, "198.51.100.9");
+    CHECK(proxy_verdict(config, &addr) == IC_MATCH_TRUSTED,
+          "global trusted proxy not inherited");
+}
+
+/* A Strict or Off listener overrides the virtual host's IncapsulaEngine,
+ * an On listener leaves it in charge
+ */
+static void test_listener(void)
+{
+    static const int policies[][2] = {
+        /* listener, IncapsulaEngine */
+        { IC_ACTIVE_STRICT, IC_ACTIVE_OFF },
+        { IC_ACTIVE_OFF, IC_ACTIVE_ON },
+        { IC_ACTIVE_ON, IC_ACTIVE_OFF },
+        { IC_ACTIVE_ON, IC_ACTIVE_ON }
+    };
+    static const int want[] = { HTTP_FORBIDDEN, OK, OK, OK };
+    static const char *const want_ip[] = {
+        "8.8.8.8", "199.83.128.1", "199.83.128.1", "1.2.3.4"
+    };
+    apr_array_header_t *listeners = apr_array_make(test_pool, 1,
+                                        sizeof(incapsula_listener_t));
+    incapsula_listener_t *listener = apr_array_push(listeners);
+    int i;
+
+    memset(listener, 0, sizeof(*listener));
+    listener->port = 8080;
+    incapsula_listeners = listeners;
+
+    for (i = 0; i < (int) (sizeof(policies) / sizeof(policies[0])); ++i) {
+        server_rec *s = test_proxies(proxies, IC_ENGINE_AUTO);
+        const char *peer = i ? "199.83.128.1" : "8.8.8.8";
+        apr_pool_t *p;
+        conn_rec *c;
+        request_rec *r;
+        int status;
+
+        listener->policy = policies[i][0];
+        test_config(s)->active = policies[i][1];
+
+        apr_pool_create(&p, test_pool);
+        c = test_conn(p, s, peer);
+        c->local_addr = test_sockaddr(p, "10.0.0.1");
+        c->local_addr->port = 8080;
+        incapsula_pre_connection(c, NULL);
+        r = test_request(p, c, "1.2.3.4");
+        status = incapsula_modify_connection(r);
+        CHECK(status == want[i] && !strcmp(test_client_ip(c), want_ip[i]),
+              "listener policy %d, IncapsulaEngine %d: %d, %s",
+              policies[i][0], policies[i][1], status, test_client_ip(c));
+        apr_pool_destroy(p);
+    }
+    incapsula_listeners = NULL;
+}
+
+/* Where trusted proxies and exemptions overlap, the proxy's verdict
+ * wins inside the proxy range on every engine, as it does in the
+ * linear engine's list order
+ */
+static void test_overlap(void)
+{
+    static const char *const trusted[] = {
+        "199.83.128.0/21", "192.0.2.8/29", NULL
+    };
+    static const struct {
+        const char *ip;
+        int verdict;
+    } cases[] = {
+        { "199.83.128.5", IC_MATCH_TRUSTED },
+        { "199.83.128.6", IC_MATCH_TRUSTED },
+        { "192.0.2.9", IC_MATCH_TRUSTED },
+        { "192.0.2.100", IC_MATCH_EXEMPT },
+        { "8.8.8.8", IC_MATCH_NONE }
+    };
+    int e, i;
+
+    for (e = 0; e < NENGINES; ++e) {
+        server_rec *s = test_proxies(trusted, engines[e]);
+        incapsula_config_t *config = test_config(s);
+
+        test_directive(s, exempt_set, NULL, "199.83.128.5/32");
+        test_directive(s, exempt_set, NULL, "192.0.2.0/24");
+        compile_matcher(test_pool, s, config);
+
+        for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); ++i) {
+            incapsula_addr_t addr;
+            int got;
+
+            decode_hop(&addr, cases[i].ip);
+            got = proxy_verdict(config, &addr);
+            CHECK(got == cases[i].verdict, "engine %s, %s: %d, want %d",
+                  ic_engine_names[config->matcher->engine], cases[i].ip,
+                  got, cases[i].verdict);
+        }
+    }
+}
+
+/* Keepalive requests repeating the header of an earlier one, after a
+ * request in between reverted the connection, are translated again
+ */
+static void test_keepalive(void)
+{
+    static const char *const headers[] = { "1.2.3.4", "10.0.0.1", "1.2.3.4" };
+    static const char *const want[] = { "1.2.3.4", "199.83.128.1", "1.2.3.4" };
+    server_rec *s = test_proxies(proxies, IC_ENGINE_AUTO);
+    apr_pool_t *p;
+    conn_rec *c;
+    int i;
+
+    apr_pool_create(&p, test_pool);
+    c = test_conn(p, s, "199.83.128.1");
+    for (i = 0; i < (int) (sizeof(headers) / sizeof(headers[0])); ++i) {
+        request_rec *r = test_request(p, c, headers[i]);
+        const char *env;
+
+        incapsula_modify_connection(r);
+        env = apr_table_get(r->subprocess_env, "INCAP_CLIENT_IP");
+        CHECK(!strcmp(test_client_ip(c), want[i])
+                  && str_eq(env, i == 1 ? NULL : want[i]),
+              "request %d (%s): client ip %s, INCAP_CLIENT_IP %s", i + 1,
+              headers[i], test_client_ip(c), env ? env : "unset");
+    }
+    apr_pool_destroy(p);
+}
+
+/* A small PRNG, so that failures reproduce */
+static apr_uint32_t rnd_state = 2463534242u;
+
+static apr_uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* An address out of a few pools: the trusted ranges below, their
+ * neighbourhood, private ranges, IPv4-mapped and IPv6
+ */
+static const char *rnd_ip(apr_pool_t *p)
+{
+    apr_uint32_t r = rnd();
+
+    switch (r % 8) {
+    case 0:
+    case 1:
+        return apr_psprintf(p, "100.64.%u.%u", (r >> 8) % 8, (r >> 16) % 256);
+    case 2:
+        return apr_psprintf(p, "100.%u.%u.%u", 60 + (r >> 8) % 8,
+                            (r >> 12) % 256, (r >> 20) % 256);
+    case 3:
+        return apr_psprintf(p, "10.0.%u.%u", (r >> 8) % 4, (r >> 16) % 256);
+    case 4:
+        return apr_psprintf(p, "::ffff:100.64.%u.%u", (r >> 8) % 8,
+                            (r >> 16) % 256);
+    case 5:
+        return apr_psprintf(p, "2001:db8:%x::%x", (r >> 8) % 4,
+                            (r >> 16) % 16);
+    case 6:
+        return apr_psprintf(p, "%u.%u.%u.%u", 1 + (r >> 8) % 223,
+                            (r >> 16) % 256, (r >> 24) % 256, r % 251);
+    default:
+        return (r >> 8) % 4 ? "100.64.0.1" : "junk";
+    }
+}
+
+/* Random proxy lists of up to IC_VECTOR_MAX IPv4 ranges, so the vector
+ * engine takes them all, and random chains walked by every engine
+ */
+static void test_random(void)
+{
+    int round, e, i;
+
+    for (round = 0; round < 200; ++round) {
+        apr_pool_t *p;
+        const char *list[IC_VECTOR_MAX + 4];
+        int n = 0;
+        int nv4 = 1 + rnd() % IC_VECTOR_MAX;
+
+        apr_pool_create(&p, test_pool);
+        for (i = 0; i < nv4; ++i) {
+            apr_uint32_t r = rnd();
+            int bits = 20 + r % 13;
+
+            list[n++] = apr_psprintf(p, "100.%u.%u.%u/%d", 60 + r % 8,
+                                     (r >> 8) % 256, (r >> 16) % 256, bits);
+        }
+        if (rnd() % 2)
+            list[n++] = "2001:db8:1::/48";
+        list[n] = NULL;
+
+        for (e = 0; e < NENGINES; ++e) {
+            server_rec *s = test_proxies(list, engines[e]);
+
+            test_config(s)->deny_all = round % 2;
+            for (i = 0; i < 50; ++i) {
+                const char *chain = rnd_ip(p);
+                const char *peer;
+                int hops = rnd() % 6;
+
+                while (hops--)
+                    chain = apr_pstrcat(p, rnd_ip(p), ", ", chain, NULL);
+                do {
+                    peer = rnd_ip(p);
+                } while (!strcmp(peer, "junk"));
+                check_walk(s, engines[e], peer, chain);
+            }
+        }
+        apr_pool_destroy(p);
+    }
+}
+
+/* The verdict proxy_verdict() gives the walk for sa */
+static int test_verdict(const incapsula_config_t *config, apr_sockaddr_t *sa)
+{
+    incapsula_addr_t addr;
+
+    addr_from_sockaddr(&addr, sa);
+    return proxy_verdict(config, &addr);
+}
+
+/* Every engine classifies addresses as the linear engine's
+ * apr_ipsubnet_test() loop, on lists past the vector and eytzinger
+ * thresholds too
+ */
+static void test_classify(void)
+{
+    static const int sizes[] = { 8, 300, 3000 };
+    int k, e, i;
+
+    for (k = 0; k < (int) (sizeof(sizes) / sizeof(sizes[0])); ++k) {
+        apr_pool_t *p;
+        const char **list;
+        server_rec *servers[NENGINES];
+
+        apr_pool_create(&p, test_pool);
+        list = apr_pcalloc(p, (sizes[k] + 1) * sizeof(*list));
+        for (i = 0; i < sizes[k]; ++i) {
+            apr_uint32_t r = rnd();
+
+            list[i] = apr_psprintf(p, "%u.%u.%u.0/%d", 1 + r % 8,
+                                   (r >> 8) % 256, (r >> 16) % 256,
+                                   16 + (r >> 24) % 17);
+        }
+        for (e = 0; e < NENGINES; ++e)
+            servers[e] = test_proxies(list, engines[e]);
+
+        for (i = 0; i < 20000; ++i) {
+            apr_uint32_t r = rnd();
+            const char *ip = apr_psprintf(p, "%s%u.%u.%u.%u",
+                                          r % 5 ? "" : "::ffff:",
+                                          1 + r % 8, (r >> 8) % 256,
+                                          (r >> 16) % 256, (r >> 24) % 256);
+            apr_sockaddr_t *sa = test_sockaddr(p, ip);
+            int want = test_verdict(test_config(servers[0]), sa);
+
+            for (e = 1; e < NENGINES; ++e) {
+                int got = test_verdict(test_config(servers[e]), sa);
+
+                CHECK(got == want, "%d ranges, engine %s, %s: %d, "
+                      "apr_ipsubnet_test %d", sizes[k],
+                      ic_engine_names[
+                          test_config(servers[e])->matcher->engine],
+                      ip, got, want);
+            }
+        }
+        apr_pool_destroy(p);
+    }
+}
+
+int main(void)
+{
+    test_init();
+
+    test_cases();
+    test_mapped_range();
+    test_deny();
+    test_merge();
+    test_listener();
+    test_overlap();
+    test_keepalive();
+    test_random();
+    test_classify();
+
+    printf("%d checks, %d failed\n", tests, failures);
+    return failures != 0;
+}